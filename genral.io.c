@@ -11,6 +11,20 @@
 #define TIMER_BASE            0xFF202000
 #define PIXEL_BUF_CTRL_BASE   0xFF203020
 #define CHAR_BUF_CTRL_BASE    0xFF203030
+#define AUDIO_BASE            0xFF203040
+#define PS2_BASE              0xFF200100
+
+/* Cortex A9 MPCore devices */
+#define MPCORE_PRIV_TIMER     0xFFFEC600
+#define MPCORE_GLOBAL_TIMER   0xFFFEC200
+#define MPCORE_GIC_CPUIF      0xFFFEC100
+#define MPCORE_GIC_DIST       0xFFFED000
+
+/* the A9 private timer counts at CPU_HZ, a game tick is TICK_CYCLES + 1 of its cycles */
+#define CPU_HZ 200000000
+#define TICK_CYCLES 50000000
+#define FRAME_HZ 60					//vga refresh, the frame scheduler is driven by its vertical sync
+#define FRAME_CYCLES (CPU_HZ / FRAME_HZ)
 
 /* VGA colors */
 #define WHITE 0xFFFF
@@ -25,20 +39,72 @@
 #define ORANGE 0xFC00
 
 #define ABS(x) (((x) > 0) ? (x) : -(x))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 	
 #define true 1
 #define false 0
 
 
+/* input event types */
+#define INPUT_END 0			//only used to close a replay
+#define INPUT_DIRECTION 1
+#define INPUT_SELECT 2
+#define INPUT_MOVE 3		//moves the units of a tile directly, for the computer player
+
+/* replays are recorded into a fixed buffer, the board has no files */
+#define REPLAY_BYTES 65536
+#define REPLAY_VERSION 3		//maps of a seed changed with the generator in version 2, sizes became varints in 3
+
+/* ticks a snapshot ring keeps, so how far back a late input can be rolled back.
+   every match server room holds a ring of whole GameStates, so a room takes about 12 KB
+   at 16x12 but about 4.4 MB in a 256x256 build */
+#define SNAPSHOT_FRAMES 8
+
+/* size of the input event queue, must be a power of two */
+#define INPUT_QUEUE_SIZE 64
+
+/* bitboards hold one bit per tile, tile (x, y) is bit y * GRID_X + x */
+#define BB_WORDS ((GRID_X*GRID_Y + 63)/64)
+/* summaries hold one bit per bitboard word, so sparse boards of large maps are walked quickly */
+#define BB_SUMMARY_WORDS ((BB_WORDS + 63)/64)
+
 /* Move Directions */
 #define UP 1
 #define DOWN 2
 #define LEFT 3
 #define RIGHT 4
 	
-/* X and Y size of the grid*/
+/* units each base and tower produces, once every PRODUCTION_INTERVAL ticks */
+#ifndef PRODUCTION_INTERVAL
+#define PRODUCTION_INTERVAL 4
+#endif
+
+/* tries at placing the second base far enough from the first one */
+#define MAP_BASE_TRIES 64
+
+/* terrain split of a new map in percent, towers get the rest */
+#ifndef EMPTY_CHANCE
+#define EMPTY_CHANCE 85
+#endif
+#ifndef MOUNTAIN_CHANCE
+#define MOUNTAIN_CHANCE 10
+#endif
+
+/* X and Y size of the grid, the largest map the build can hold. host builds can raise it,
+   for example -DGRID_X=256 -DGRID_Y=256 */
+#ifndef GRID_Y
 #define GRID_Y	12
+#endif
+#ifndef GRID_X
 #define GRID_X	16
+#endif
+
+/* the part of the grid that fits on screen, the camera scrolls it over larger maps */
+#define VIEW_X ((GRID_X < 16) ? GRID_X : 16)
+#define VIEW_Y ((GRID_Y < 12) ? GRID_Y : 12)
+/* tiles the camera keeps between a moving cursor and the edge of the view */
+#define CAMERA_MARGIN 2
 	
 #define GRID_START_OFFSET_X 2
 #define GRID_START_OFFSET_Y 1
@@ -50,16 +116,95 @@
 #define GRID_SIZE_X 4*GRID_TEXT_SIZE
 /* top line is type, bottom line is unit count */
 #define GRID_SIZE_Y 4*LINE_PER_GRID
+
+/* units one tile can hold, counts above 255 need a wider tile and a third digit */
+#ifndef MAX_UNIT
 #define MAX_UNIT 99
+#endif
+#if MAX_UNIT > 255
+#define UNIT_TYPE unsigned short
+#else
+#define UNIT_TYPE unsigned char
+#endif
+#if MAX_UNIT > 99
+#define UNIT_DIGITS 3
+#else
+#define UNIT_DIGITS 2
+#endif
 	
 #define GRID_START_X GRID_START_OFFSET_X*GRID_SIZE_X
 #define GRID_START_Y GRID_START_OFFSET_Y*GRID_SIZE_Y
-#define GRID_END_X GRID_SIZE_X*GRID_X+GRID_START_X
-#define GRID_END_Y GRID_SIZE_Y*GRID_Y+GRID_START_Y
+#define GRID_END_X GRID_SIZE_X*VIEW_X+GRID_START_X
+#define GRID_END_Y GRID_SIZE_Y*VIEW_Y+GRID_START_Y
 	
 #define GRID_COLOR WHITE
 	
 #define BACKGROUND_COLOR 0x0000
+
+/* bytes between the start of two rows in the pixel buffer */
+#define PIXEL_ROW_BYTES 1024
+
+/* size of the character buffer, and bytes between the start of two of its rows */
+#define CHAR_BUF_WIDTH 80
+#define CHAR_BUF_HEIGHT 60
+#define CHAR_ROW_BYTES 128
+/* character row of the tick and tile counts above the grid */
+#define HUD_ROW 1
+
+/* damage tracking, one damage list for each of the two frame buffers */
+#define FRAME_BUFFER_COUNT 2
+#define DAMAGE_LIST_SIZE (VIEW_X*VIEW_Y)	//only tiles in view are damaged, the list is drained when it would overflow
+/* the selection plus its 4 flashing neighbours, for each side */
+#define MAX_HIGHLIGHTS 10
+/* shown unit counts take one easing step per this many timer cycles */
+#define ANIMATION_STEP_CYCLES FRAME_CYCLES
+
+/* audio codec, both channels take 32 bit samples */
+#define AUDIO_RATE 8000
+#define AUDIO_FIFO_SIZE 128
+#define AUDIO_SHIFT 13			//from the mix to a codec sample, four voices at full volume still fit
+#define AUDIO_VOICES 4
+#define MUSIC_VOICE 0			//the others play the sound effects
+#define WAVE_BITS 8
+#define WAVE_SIZE (1 << WAVE_BITS)
+#define WAVE_SQUARE 0
+#define WAVE_TRIANGLE 1
+#define WAVE_SINE 2
+#define WAVE_NOISE 3
+#define WAVE_COUNT 4
+
+/* sounds */
+#define SOUND_SELECT 0
+#define SOUND_EXPAND 1
+#define SOUND_CAPTURE 2
+#define SOUND_WIN 3
+#define SOUND_MUSIC 4			//loops while switch 2 is on
+#define SOUND_COUNT 5
+
+/* a tile sprite covers the tile and the grid lines around it, neighbours share their lines */
+#define TILE_SPRITE_WIDTH (GRID_SIZE_X+1)
+#define TILE_SPRITE_HEIGHT (GRID_SIZE_Y+1)
+#define TILE_SPRITE_PIXELS (TILE_SPRITE_WIDTH*TILE_SPRITE_HEIGHT)
+/* unit counts are blitted as one sprite per count, in a 5x7 font or a 3x5 one for three digits */
+#if MAX_UNIT > 999
+#error "unit counts are drawn with at most 3 digits"
+#endif
+#if UNIT_DIGITS > 2
+#define UNIT_GLYPH_WIDTH 3
+#define UNIT_GLYPH_HEIGHT 5
+#else
+#define UNIT_GLYPH_WIDTH 5
+#define UNIT_GLYPH_HEIGHT 7
+#endif
+#define UNIT_SPRITE_WIDTH (UNIT_DIGITS*(UNIT_GLYPH_WIDTH+1) - 1)
+#define UNIT_SPRITE_HEIGHT UNIT_GLYPH_HEIGHT
+#define UNIT_SPRITE_PIXELS (UNIT_SPRITE_WIDTH*UNIT_SPRITE_HEIGHT)
+/* where the unit count and the 3x5 terrain letter sit in a tile sprite */
+#define UNIT_SPRITE_X ((TILE_SPRITE_WIDTH - UNIT_SPRITE_WIDTH)/2)
+#define UNIT_SPRITE_Y (TILE_SPRITE_HEIGHT - 2 - UNIT_SPRITE_HEIGHT)
+#define TERRAIN_GLYPH_X ((TILE_SPRITE_WIDTH - 3)/2)
+#define TERRAIN_GLYPH_Y 2
+#define SPRITE_TEXT_COLOR WHITE
 	
 /*tile types*/
 #define EMPTY 0
@@ -78,10 +223,272 @@
 	
 #define FIRST_SELECT_COLOR CYAN
 #define SECOND_SELECT_COLOR MAGENTA
+
+/* computer player, a round is one move of each side followed by AI_TICKS_PER_ROUND ticks */
+#define AI_TICKS_PER_ROUND 1
+#define AI_ROLLOUT_ROUNDS 24
+#define AI_EXPLORATION 0.7f
+#define AI_BOARD_CYCLES (FRAME_CYCLES / 4)	//search time per tick on the board, so the main loop keeps drawing
+#define AI_BOT_PLAYOUTS 200			//per move of the tournament bot, a count keeps its results the same on any host
+#define AI_EMULATED_PLAYOUTS 200	//per tick in the emulator instead of AI_BOARD_CYCLES, whose host clock would make runs differ
+#define AI_MATCH_ROUNDS 400			//host benchmark matches are cut off after this
+#ifdef HOST_BUILD
+#define AI_MAX_THREADS 32
+#define AI_NODE_POOL (1 << 17)
+#else
+#define AI_MAX_THREADS 1
+#define AI_NODE_POOL (1 << 15)
+#endif
 	
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#ifdef HOST_BUILD
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+//everything the game knows about one tile, packed into 3 bytes (6 when MAX_UNIT needs a short)
+struct Tile{
+	UNIT_TYPE unitCount;			//at most MAX_UNIT
+	UNIT_TYPE animatedUnitCount;	//the count shown on screen, eases towards unitCount
+	unsigned char terrain : 2;
+	unsigned char faction : 2;
+};
+
+struct Bitboard{
+	unsigned long long word[BB_WORDS];
+};
+
+//the complete state of one match, nothing in here touches the hardware
+struct GameState{
+	int width;				//map size, at most GRID_X by GRID_Y
+	int height;
+	int tick;				//ticks simulated so far
+	int winner;				//NONE until a side took the base of the other from it
+	unsigned long long randomState;	//pcg32 state of the match generator
+	int mapRepairs;			//mountains gameInit removed to connect the bases
+	
+	//selection cursor of each side, indexed by faction
+	int cursorX[3];
+	int cursorY[3];
+	int isSelecting[3];
 	
+	struct Bitboard boardMask;			//every tile on the map
+	struct Bitboard notLeftColumn;		//tiles that have a left neighbour
+	struct Bitboard notRightColumn;		//tiles that have a right neighbour
+	struct Bitboard mountainBoard;
+	struct Bitboard baseBoard;
+	struct Bitboard towerBoard;
+	struct Bitboard ownedBoard[3];		//tiles owned by each faction, indexed by faction
+	struct Bitboard producerBoard;		//owned bases and towers
+	struct Bitboard changedBoard;		//tiles changed since the renderer last collected them
+	unsigned long long producerWords[BB_SUMMARY_WORDS];	//bit w may be set while producerBoard.word[w] has bits
+	unsigned long long changedWords[BB_SUMMARY_WORDS];	//the same for changedBoard
+	int homeBase[3];			//tile index of the starting base of each faction
+	int ownedCount[3];			//tiles in each ownedBoard
+	
+	//stored row by row, the same order the screen and the bitboards use
+	struct Tile tiles[GRID_Y][GRID_X];
+};
+
+//a decoded key press, stamped with the tick it arrived at
+struct InputEvent{
+	int tick;
+	char type;
+	char side;
+	char direction;
+	char half;		//move half of the units instead of all but one
+	unsigned short x;	//tile of an INPUT_MOVE
+	unsigned short y;
+};
+
+//the seed and every applied input of one match, see Replay
+struct Replay{
+	unsigned char data[REPLAY_BYTES];
+	int length;
+	int lastTick;
+	int overflow;		//the buffer filled up, the replay stops at the last input that fit
+};
+
+struct ReplayReader{
+	unsigned char * data;
+	int length;
+	int position;
+	int nextTick;
+	struct InputEvent next;		//the entry at nextTick, not applied yet
+	int error;
+};
+
+//the last SNAPSHOT_FRAMES saved ticks of one match, see Snapshots
+struct SnapshotRing{
+	struct GameState frame[SNAPSHOT_FRAMES];
+	int newest;		//frame saved last
+	int count;		//frames saved, newest and the ones before it
+};
+
+//one move of a side, direction NONE passes
+struct AiMove{
+	unsigned short x;
+	unsigned short y;
+	unsigned char direction;
+	unsigned char half;
+};
+
+struct AiNode{
+	int parent;
+	int firstChild;			//children are stored next to each other, -1 until expanded
+	int childCount;
+	int visits;
+	float score;			//summed results for the side that made the move
+	struct AiMove move;		//the move that led here
+	unsigned char mover;
+};
+
+//one search tree and its node pool, every thread owns one so nothing is shared while searching
+struct AiSearch{
+	struct AiNode nodes[AI_NODE_POOL];
+	int nodeCount;
+	unsigned int seed;
+	struct GameState root;
+	int side;
+	int playouts;			//playouts to run, unless the deadline comes first
+	double deadline;		//host seconds, 0 for no time limit
+	unsigned int startCycles;	//board deadline, measured with halCycles
+	unsigned int budgetCycles;	//0 for no time limit
+	int playoutsDone;
+};
+
+//one note of a sound, see Audio
+struct Note{
+	unsigned short frequency;
+	unsigned short length;
+};
+
+struct Sound{
+	int wave;
+	int volume;			//up to 255
+	const struct Note * notes;
+};
+
+struct Voice{
+	const struct Sound * sound;
+	const struct Note * note;	//the note playing, 0 while the voice is free
+	int loop;
+	unsigned int phase;			//position in the wavetable, a full period is 2^32
+	unsigned int step;			//phase added per sample
+	int level;					//volume in 16.16 fixed point, lowered by decay every sample
+	int decay;
+	int samplesLeft;			//of the note
+};
+
+/* game core, see Game Logic */
+void gameInit(struct GameState * state, int width, int height, unsigned int seed);
+int gameApplyMove(struct GameState * state, int side, int x, int y, int direction, int moveHalf);
+void gameApplyInput(struct GameState * state, struct InputEvent * event);
+void gameStep(struct GameState * state, int ticks);
+int gameGetWinner(struct GameState * state);
+void gameMoveCursor(struct GameState * state, int side, int direction);
+int getMoveTarget(struct GameState * state, int x, int y, int direction, int * targetX, int * targetY);
+struct Tile * getTile(struct GameState * state, int x, int y);
+void setTileFaction(struct GameState * state, int x, int y, int faction);
+void setTileUnitCount(struct GameState * state, int x, int y, int count);
+int get_random(struct GameState * state, int limit);
+unsigned int nextRandom(struct GameState * state);
+void seedRandom(struct GameState * state, unsigned int seed);
+int connectBases(struct GameState * state, int fromX, int fromY, int toX, int toY);
+int getDistance(int x1, int y1, int x2, int y2);
+int getMoveDirection(int keyCode);
+
+/* replays, see Replay */
+void replayStart(struct Replay * replay, int width, int height, unsigned int seed);
+void replayRecordInput(struct Replay * replay, int tick, struct InputEvent * event);
+void replayFinish(struct Replay * replay, int tick);
+int replayOpen(struct ReplayReader * reader, unsigned char * data, int length, struct GameState * state);
+int replayAdvance(struct ReplayReader * reader, struct GameState * state, int untilTick);
+unsigned int gameHash(struct GameState * state);
+
+/* snapshots, see Snapshots */
+int snapshotBytes(struct GameState * state);
+void snapshotReset(struct SnapshotRing * ring);
+void snapshotSave(struct SnapshotRing * ring, struct GameState * state);
+int snapshotRestore(struct SnapshotRing * ring, struct GameState * state, int tick);
+int snapshotOldestTick(struct SnapshotRing * ring);
+
+void initBitboards(struct GameState * state);
+void bbSet(struct Bitboard * bb, int x, int y);
+void bbClear(struct Bitboard * bb, int x, int y);
+int bbTest(struct Bitboard * bb, int x, int y);
+int bbAny(struct Bitboard bb);
+int bbNextSet(struct Bitboard * bb, int from);
+void bbReset(struct Bitboard * bb);
+struct Bitboard bbAnd(struct Bitboard a, struct Bitboard b);
+struct Bitboard bbOr(struct Bitboard a, struct Bitboard b);
+struct Bitboard bbAndNot(struct Bitboard a, struct Bitboard b);
+struct Bitboard bbShiftHigher(struct Bitboard bb, int n);
+struct Bitboard bbShiftLower(struct Bitboard bb, int n);
+struct Bitboard bbNeighbours(struct GameState * state, struct Bitboard bb);
+
+/* computer player, see Computer Player */
+int aiChooseMove(struct GameState * state, int side, int playouts, double seconds, struct AiMove * best);
+int aiSearchMove(struct AiSearch * searches, int threads, struct GameState * state, int side, int playouts, double seconds, struct AiMove * best);
+void aiGreedyMove(struct GameState * state, int side, struct AiMove * best);
+int aiPlayMove(struct GameState * state, int side, struct AiMove * move);
+int aiNextMove(struct GameState * state, int side, struct AiMove * move);
+void aiPassMove(struct AiMove * move);
+float aiEvaluate(struct GameState * state, int side);
+void aiRunSearch(struct AiSearch * search);
+int playRandomMove(struct GameState * state, int side);
+int getOpponent(int side);
+
+#ifdef HOST_BUILD
+double getSeconds();
+#endif
+
+#ifndef GENERAL_LIBRARY
+/* ↓↓↓ Hardware Abstraction ↓↓↓ */
+//every device access goes through these, on the board they are plain volatile accesses
+//and a host build hands them to the emulator in Host Emulator instead
+#ifdef HOST_BUILD
+int halRead32(unsigned int address);
+int halRead16(unsigned int address);
+int halRead8(unsigned int address);
+void halWrite32(unsigned int address, int value);
+void halWrite16(unsigned int address, int value);
+void halWrite8(unsigned int address, int value);
+char * halMemory(unsigned int address);	//where the pixel and character buffers are, for the span kernels
+void halCountStores(int count);			//the span kernels store through halMemory, so they count for themselves
+int halRunning();
+unsigned int halCycles();	//cycle stamp for timing frames, only differences between two stamps mean anything
+unsigned int halCounter();	//free running cycle counter for the profiler, also moves inside interrupt handlers
+#else
+#define halRead32(address) (*(volatile int *)(address))
+#define halRead16(address) (*(volatile short *)(address))
+#define halRead8(address) (*(volatile char *)(address))
+#define halWrite32(address, value) (*(volatile int *)(address) = (value))
+#define halWrite16(address, value) (*(volatile short *)(address) = (value))
+#define halWrite8(address, value) (*(volatile char *)(address) = (value))
+#define halMemory(address) ((char *)(address))
+#define halCountStores(count) ((void)(count))
+#define halRunning() true
+unsigned int halCycles();
+#define halCounter() ((unsigned int)halRead32(MPCORE_GLOBAL_TIMER))	//low word of the A9 global timer
+#endif
+/* ↑↑↑ Hardware Abstraction ↑↑↑ */
+
 volatile int pixel_buffer_start; // global variable
 
 void initializeBuffer();
@@ -89,56 +496,196 @@ void plot_pixel(int, int, short int);
 void swap(int *, int *);
 
 void clear_screen();
+void clear_pixel_buffer();
+void clear_char_buffer();
+void clear_rect(int left, int top, int right, int bottom);
+void fill_text_rect(int left, int top, int right, int bottom, char val);
+int move_block(unsigned int base, int rowBytes, int left, int top, int right, int bottom, int dx, int dy);
+void blit_sprite(unsigned short * sprite, int width, int height, int x, int y);
+unsigned short * pixelAddress(int x, int y);
+int pixelRowStep();
+void countPixelStores(int pixels, int stores);
 void draw_line(int x0, int y0, int x1, int y1, short int color);
+void draw_hline(int x0, int x1, int y, short int color);
+void draw_vline(int x, int y0, int y1, short int color);
+void draw_rect(int left, int top, int right, int bottom, short int color);
+void fill_rect(int left, int top, int right, int bottom, short int color);
 
 void wait_sync();
-void drawGrid();
+int swapFinished();
+int drawGrid();
+void markTileDirty(int gridX, int gridY);
+void markAllTilesDirty();
+void collectChangedTiles();
+int getBackBufferIndex();
+void addHighlight(int x, int y, int side);
+int updateHighlights(int buffer);
+void damageTile(int buffer, int gridX, int gridY);
+void clearDamage(int buffer);
+int inView(int gridX, int gridY, int viewX, int viewY);
+void centerCamera(int side);
+void followCursor(int side);
+void updateCamera();
+void scrollBuffer(int buffer);
 void doRender();
+void doAnimation();
 void doGameTick();
+void gameLoop();
 void setup();
 void setupGrid();
-void drawUnitCount(int gridX, int gridY);
-void drawTileType(int gridX, int gridY);
-void drawTileFaction(int gridX, int gridY);
-void drawDigit(int x, int y, int val);
+void buildSprites();
+void drawTile(int gridX, int gridY, int highlight);
+void renderNumber(int x, int y, int value, int width);
+void flushText();
+void drawHud();
 void drawAscii(int x, int y, char val);
 void drawSelection(int side);
-int getMoveDirection(int keyCode);
 void drawHighlight(int x, int y, int side);
+int tilePixelWrites(int gridX, int gridY);
+int fullRedrawPixelWrites();
 void flashHighlight(int side);
-void tryMoveUnit(int side, int x, int y, int direction);
-int get_random(int limit);
-void generateChipTune();
+void buildWaveTables();
+void mixAudio(int * out, int count);
+void playSound(int sound);
+void updateMusic(int on);
 void renderText(int x, int y, char* text);
 void drawHelp();
 
-int unitCount[GRID_X][GRID_Y];
-int animatedUnitCount[GRID_X][GRID_Y];
-int gridTerrain[GRID_X][GRID_Y];
-int tileFaction[GRID_X][GRID_Y];
+struct GameState game;	//the match on screen
+struct Replay currentReplay;	//the match on screen so far
+
+unsigned char tileDamage[GRID_Y][GRID_X];	//bit n is set while the tile is in the damage list of buffer n
+int damageList[FRAME_BUFFER_COUNT][DAMAGE_LIST_SIZE];	//damaged tiles stored as y * GRID_X + x
+int damageCount[FRAME_BUFFER_COUNT];
+int animatingTiles[GRID_X*GRID_Y];	//tiles whose shown count has not reached unitCount yet, as y * GRID_X + x
+int animatingCount;
+struct Bitboard animatingBoard;	//the same tiles, so none is listed twice
+unsigned int animationCycles;	//timer time the shown counts were last eased at
+int fullRedraw[FRAME_BUFFER_COUNT];	//buffer was cleared, every tile must be drawn
+
+//built once by buildSprites, indexed by terrain, faction and the side highlighting the tile
+unsigned short tileSprites[4][3][3][TILE_SPRITE_HEIGHT][TILE_SPRITE_WIDTH];
+unsigned short unitSprites[MAX_UNIT + 1][UNIT_SPRITE_HEIGHT][UNIT_SPRITE_WIDTH];
+unsigned short * spriteTarget;	//the sprite the span kernels draw into, 0 for the back buffer
+int spriteTargetWidth;
+
+//the camera is the top left tile of the view. every buffer remembers where it was drawn,
+//so it can be scrolled by moving what it already holds
+int cameraX;
+int cameraY;
+int bufferCameraX[FRAME_BUFFER_COUNT];
+int bufferCameraY[FRAME_BUFFER_COUNT];
+int followedCursorX[3];	//cursor positions the camera last saw, indexed by faction
+int followedCursorY[3];
 
-int playerOneSelectX;
-int playerOneSelectY;
+//highlights are stored as (y * GRID_X + x) * 4 + side
+int wantedHighlight[MAX_HIGHLIGHTS];
+int wantedHighlightCount;
+int drawnHighlight[FRAME_BUFFER_COUNT][MAX_HIGHLIGHTS];	//what each buffer holds right now
+int drawnHighlightCount[FRAME_BUFFER_COUNT];
 
-int playerTwoSelectX;
-int playerTwoSelectY; 
+int framePixelWrites;		//pixel writes made by the last frame
+int frameCharWrites;		//character writes made by the last frame
+int framePixelWritesSaved;	//pixel writes the last frame skipped compared to a full redraw
+int frameCharWritesSaved;	//character writes the last frame skipped compared to writing all its text
+unsigned long long totalPixelWritesSaved;	//sums of the two above over all frames
+unsigned long long totalCharWritesSaved;
 
-int isPlayerOneSelecting;
-int isPlayerTwoSelecting;
+//text is written into textShadow, and flushText only sends the words that differ from textShown
+char textShadow[CHAR_BUF_HEIGHT][CHAR_BUF_WIDTH];
+char textShown[CHAR_BUF_HEIGHT][CHAR_BUF_WIDTH];	//what the character buffer holds
+unsigned long long textDirtyRows;	//bit n is set once row n of textShadow was written to
+int textCharsWritten;		//characters written into textShadow since the last frame, so text written between frames counts for the next one
+int hudTick = -1;		//the tick the hud shows, -1 once the character buffer was cleared
+int hudOwned[3];		//the tile counts the hud shows
 
 unsigned char PS2Bytes[3];	//ps2 packets are always at most 3 bytes
 
 int currentTrueTick;
-int currentCalculatedTick;
+unsigned int randomSeed;	//advanced while waiting for the player, used for the next map
 
+int tickLag;			//ticks the simulation was behind when doGameTick last ran
+int peakTickLag;		//worst lag since setup
+int laggingTicks;		//true ticks since setup the simulation spent more than one tick behind
+
+//a frame is the work from one swap to the next swap request, measured against one refresh
+int swapPending;				//the back buffer is drawn and waits for the vertical sync
+unsigned int frameStartCycles;	//when the last swap was shown
+int frameWorkCycles;			//ticks and drawing of the last frame
+int frameBudgetUsed;			//frameWorkCycles in percent of FRAME_CYCLES
+int peakFrameBudgetUsed;
+unsigned long long totalFrameWorkCycles;
+int budgetFrames;
+int overBudgetFrames;			//frames that missed the vertical sync they were drawn for
+
+//only used by the keyboard interrupt while decoding
 int playerOnePressShift;
 int playerTwoPressShift;
 
+struct InputEvent inputQueue[INPUT_QUEUE_SIZE];
+volatile unsigned int inputQueueHead;	//only written by the keyboard interrupt
+volatile unsigned int inputQueueTail;	//only written by the main loop
+int droppedInputEvents;
+
+int pushInputEvent(int type, int side, int direction, int half);
+struct InputEvent * peekInputEvent();
+void popInputEvent();
+void flushInputEvents();
+
+int aiLastTick;		//the computer player moves once every tick
+
 int gameEnded = false;
 int needInitialize = false;
 int needAnimation = false;
 
-volatile int * LEDAddress = (int *)0xff200000;
+//build with -DENABLE_PROFILER to time the stages of a frame and the interrupt handlers,
+//without it every PROFILE_ macro is empty and nothing of the profiler is compiled
+#ifdef ENABLE_PROFILER
+#define PROFILE_TICK 0
+#define PROFILE_ANIMATION 1
+#define PROFILE_GRID 2
+#define PROFILE_HIGHLIGHTS 3	//drawSelection and flashHighlight
+#define PROFILE_SYNC 4			//from the swap request until the vertical sync showed it
+#define PROFILE_PS2_IRQ 5
+#define PROFILE_TIMER_IRQ 6
+#define PROFILE_BUTTON_IRQ 7
+#define PROFILE_AUDIO_IRQ 8
+#define PROFILE_STAGES 9
+#define PROFILE_WINDOW FRAME_HZ	//frames the rolling numbers are taken over
+
+//cycles of one stage in the current window, and what the last full window showed
+struct ProfileStage{
+	unsigned int min;
+	unsigned int max;
+	unsigned long long total;
+	int count;
+	unsigned int shownMin;
+	unsigned int shownAvg;
+	unsigned int shownMax;
+	int shownCount;
+};
+
+struct ProfileStage profile[PROFILE_STAGES];
+unsigned int profileStart[PROFILE_STAGES];	//every stage has its own, so an interrupt cannot overwrite the main loop's
+unsigned int profileWindowStart;
+int profileFrames;		//frames shown in the current window
+int profileLag;			//worst tick lag of the current window
+int profileBudget;		//worst frame budget used in the current window
+int profileFps;			//frames per second over the last window
+
+void profileRecord(int stage, unsigned int cycles);
+void profilePublish();
+void profileFrame();
+
+//stages are timed with halCounter, halCycles only moves its tick count in the timer interrupt
+#define PROFILE_START(stage) profileStart[stage] = halCounter()
+#define PROFILE_END(stage) profileRecord(stage, halCounter() - profileStart[stage])
+#define PROFILE_FRAME() profileFrame()
+#else
+#define PROFILE_START(stage)
+#define PROFILE_END(stage)
+#define PROFILE_FRAME()
+#endif
 
 /* ↓↓↓ Assembly Execution Helpers ↓↓↓ */
 
@@ -150,8 +697,13 @@ void setupGIC();
 void enableInterruptFor(int irqID);
 void showWinningSide(int side);
 void initializeRandomizer();
-void writeAudio(double freq, int samplesToGenerate);
 	
+#ifdef HOST_BUILD
+//the emulator has no processor modes or stacks, and only raises interrupts between frames
+void enableInterrupt(){}
+void disableInterrupt(){}
+void setupStackPointer(){}
+#else
 void cpsr_msr(int value){
 	__asm__("msr cpsr, %[ps]"::[ps]"r"(value));
 }
@@ -179,14 +731,15 @@ void setupStackPointer(){
 	mode = 0b11010011;
 	__asm__("msr cpsr, %[ps]"::[ps]"r"(mode));
 }
+#endif
 
 void setupGIC(){
 	// Set Interrupt Priority Mask Register (ICCPMR). Enable all priorities
-	*((int *) 0xFFFEC104) = 0xFFFF;
+	halWrite32(MPCORE_GIC_CPUIF + 0x04, 0xFFFF);
 	// Set the enable in the CPU Interface Control Register (ICCICR)
-	*((int *) 0xFFFEC100) = 1;
+	halWrite32(MPCORE_GIC_CPUIF + 0x00, 1);
 	// Set the enable in the Distributor Control Register (ICDDCR)
-	*((int *) 0xFFFED000) = 1;
+	halWrite32(MPCORE_GIC_DIST + 0x00, 1);
 }
 
 void config_interrupt (int N, int CPU_target)
@@ -197,16 +750,16 @@ void config_interrupt (int N, int CPU_target)
 	reg_offset = (N >> 3) & 0xFFFFFFFC;
 	index = N & 0x1F;
 	value = 0x1 << index;
-	address = 0xFFFED100 + reg_offset;
+	address = MPCORE_GIC_DIST + 0x100 + reg_offset;
 	/* Using the address and value, set the appropriate bit */
-	*(int *)address |= value;
+	halWrite32(address, halRead32(address) | value);
 	/* Configure the Interrupt Processor Targets Register (ICDIPTRn)
 	* reg_offset = integer_div(N / 4) * 4; index = N mod 4 */
 	reg_offset = (N & 0xFFFFFFFC);
 	index = N & 0x3;
-	address = 0xFFFED800 + reg_offset + index;
+	address = MPCORE_GIC_DIST + 0x800 + reg_offset + index;
 	/* Using the address and value, write to (only) the appropriate byte */
-	*(char *)address = (char) CPU_target;
+	halWrite8(address, (char) CPU_target);
 }
 
 void enableInterruptFor(int irqID){
@@ -240,13 +793,14 @@ void enableInterruptFor(int irqID){
 /* ↓↓↓ Exception Vector Table ↓↓↓ */
 void handleIRQ(int irqID);
 
+#ifndef HOST_BUILD
 void __attribute__ ((interrupt)) __cs3_isr_irq (){
 	// Read the ICCIAR from the CPU Interface in the GIC
-	int interrupt_ID = *((int *) 0xFFFEC10C);
+	int interrupt_ID = halRead32(MPCORE_GIC_CPUIF + 0x0C);
 	
 	handleIRQ(interrupt_ID);
 	
-	*((int *) 0xFFFEC110) = interrupt_ID;
+	halWrite32(MPCORE_GIC_CPUIF + 0x10, interrupt_ID);
 	return;
 }
 // Define the remaining exception handlers
@@ -268,6 +822,7 @@ void __attribute__ ((interrupt)) __cs3_isr_dabort (){
 void __attribute__ ((interrupt)) __cs3_isr_fiq (){
 	while(1);
 }
+#endif
 
 /* ↑↑↑ Exception Vector Table ↑↑↑ */
 
@@ -278,6 +833,7 @@ void registerInterruptRequest();
 void setupDeviceInterrupt();
 void ps2IrqHandler();
 void TimerIrqHandler();
+unsigned int timerCycles();
 void ButtonIrqHandler();
 void AudioIrqHandler();
 void AnimationTimerIrqHandler();
@@ -303,52 +859,61 @@ void registerInterruptRequest(){
 	enableInterruptFor(29);	//A9 private timer
 	//enableInterruptFor(72);	//Interval timer
 	enableInterruptFor(73);	//Button
-	//enableInterruptFor(78);	//Audio
+	enableInterruptFor(78);	//Audio
 }
 
 void setupDeviceInterrupt(){
 	//add all device specific interrupt setup codes here	
 	
 	//PS2 controller
-	volatile int * ps2Address = (int *)0xFF200104;
 	//https://www-ug.eecg.toronto.edu/msl/nios_devices/dev_ps2.html
-	*(ps2Address) = 1;		//interrupt enable
+	halWrite32(PS2_BASE + 4, 1);		//interrupt enable
 	
 	
 	//A9 timer
-	volatile int * A9TimerAddress = (int *)0xfffec600;
-	*A9TimerAddress = 50000000;
-	*(int *)(A9TimerAddress + 2) = 0b110;
-	*(int *)(A9TimerAddress + 3) = 1;
+	halWrite32(MPCORE_PRIV_TIMER, TICK_CYCLES);
+	halWrite32(MPCORE_PRIV_TIMER + 8, 0b110);
+	halWrite32(MPCORE_PRIV_TIMER + 12, 1);
+	
+	//A9 global timer, free running at the rate of the private timer for the profiler
+	halWrite32(MPCORE_GLOBAL_TIMER + 8, 0b1);
 	
 	//timer
-	volatile int * IntervalTimerAddress = (int *) 0xff202000;
-	*(int *)(IntervalTimerAddress + 2) = 0xffff;
-	*(int *)(IntervalTimerAddress + 3) = 0x20;
-	*(int *)(IntervalTimerAddress + 1) = 0b1011;
-	*(int *)(IntervalTimerAddress + 0) = 0;
+	halWrite32(TIMER_BASE + 8, 0xffff);
+	halWrite32(TIMER_BASE + 12, 0x20);
+	halWrite32(TIMER_BASE + 4, 0b1011);
+	halWrite32(TIMER_BASE + 0, 0);
 	
 	//Button
-	volatile int * ButtonAddress = (int *) 0xff200050;
-	*(int *)(ButtonAddress + 2) = 0b1;
-	*(int *)(ButtonAddress + 3) = 0b111;
-	
-	//Audio
-	//volatile int * AudioAddress = (int *) 0xff203040;
-	//*(int *)(AudioAddress) = 0b10;
+	halWrite32(KEY_BASE + 8, 0b1);
+	halWrite32(KEY_BASE + 12, 0b111);
 	
+	//Audio, the write interrupt is only enabled while a sound plays
+	halWrite32(AUDIO_BASE, 0b1100);	//clear both fifos
+	halWrite32(AUDIO_BASE, 0);
+
 }
 
 void handleIRQ(int irqID){
 	//printf("interrupt received:%d\n", irqID);
 	if(irqID == 79){
+		PROFILE_START(PROFILE_PS2_IRQ);
 		ps2IrqHandler();
+		PROFILE_END(PROFILE_PS2_IRQ);
 	}else if(irqID == 29){
+		PROFILE_START(PROFILE_TIMER_IRQ);
 		TimerIrqHandler();
+		PROFILE_END(PROFILE_TIMER_IRQ);
 	}else if(irqID == 72){
 		AnimationTimerIrqHandler();
 	}else if(irqID == 73){
+		PROFILE_START(PROFILE_BUTTON_IRQ);
 		ButtonIrqHandler();
+		PROFILE_END(PROFILE_BUTTON_IRQ);
+	}else if(irqID == 78){
+		PROFILE_START(PROFILE_AUDIO_IRQ);
+		AudioIrqHandler();
+		PROFILE_END(PROFILE_AUDIO_IRQ);
 	}else{
 		while(1);	//unknown interrupt	
 	}
@@ -357,29 +922,43 @@ void handleIRQ(int irqID){
 
 void AnimationTimerIrqHandler(){
 	needAnimation = true;
-	volatile int * IntervalTimerAddress = (int *) 0xff202000;
-	*(int *)(IntervalTimerAddress) |= 0b0;
+	halWrite32(TIMER_BASE, halRead32(TIMER_BASE) | 0b0);
 }
 
 void ButtonIrqHandler(){
 	needInitialize = true;
-	volatile int * ButtonAddress = (int *) 0xff200050;
-	*(int *)(ButtonAddress + 3) = 0b111;
+	halWrite32(KEY_BASE + 12, 0b111);
 }
 
 void TimerIrqHandler(){
 	currentTrueTick += 1;		//add 1 to the game tick
 	
 	//reset timer and clear interrupt
-	volatile int * A9TimerAddress = (int *)0xfffec600;
-	*(int *)(A9TimerAddress + 3) = 1;
+	halWrite32(MPCORE_PRIV_TIMER + 12, 1);
+}
+
+//the tick count holds the whole timer periods and the down counter the part of the current one.
+//in the emulator it only moves from frame to frame, so what it drives looks the same on every host
+unsigned int timerCycles(){
+	int tick;
+	int counter;
+	do{
+		tick = *(volatile int *)&currentTrueTick;
+		counter = halRead32(MPCORE_PRIV_TIMER + 4);
+	}while(tick != *(volatile int *)&currentTrueTick);
+	return (unsigned int)tick * (TICK_CYCLES + 1) + (TICK_CYCLES - counter);
+}
+
+#ifndef HOST_BUILD
+unsigned int halCycles(){
+	return timerCycles();
 }
+#endif
 
 void ps2IrqHandler(){
 	
-	*LEDAddress |= 0b100;
-	volatile int * PS2_ptr = (int *) 0xFF200100;
-	int data = *(PS2_ptr);
+	halWrite32(LEDR_BASE, halRead32(LEDR_BASE) | 0b100);
+	int data = halRead32(PS2_BASE);
 	if((data & 0x8000) != 0){
 		PS2Bytes[0] = PS2Bytes[1];
 		PS2Bytes[1] = PS2Bytes[2];
@@ -403,18 +982,10 @@ void ps2IrqHandler(){
 		}
 	}else if(PS2Bytes[2] == 0x5A){
 		//enter	
-		if(isPlayerTwoSelecting == true){
-			isPlayerTwoSelecting = false;	
-		}else{
-			isPlayerTwoSelecting = true;	
-		}
+		pushInputEvent(INPUT_SELECT, SECOND, NONE, false);
 	}else if(PS2Bytes[2] == 0x29){
 		//space
-		if(isPlayerOneSelecting == true){
-			isPlayerOneSelecting = false;	
-		}else{
-			isPlayerOneSelecting = true;	
-		}
+		pushInputEvent(INPUT_SELECT, FIRST, NONE, false);
 	}else if(PS2Bytes[2] == 0x12){
 		playerOnePressShift = true;
 	}else if(PS2Bytes[2] == 0x14){
@@ -427,60 +998,10 @@ void ps2IrqHandler(){
 		moveSide = FIRST;
 	}
 	if(moveDirection != NONE){
-		if(moveSide == SECOND){
-			if(isPlayerTwoSelecting){
-				tryMoveUnit(SECOND, playerTwoSelectX, playerTwoSelectY, moveDirection);
-			}else{
-				switch(moveDirection){
-					case UP:
-						if(playerTwoSelectY > 0){
-							playerTwoSelectY -= 1; 
-						}
-						break;
-					case DOWN:
-						if(playerTwoSelectY < GRID_Y - 1){
-							playerTwoSelectY += 1;
-						}
-						break;
-					case LEFT:
-						if(playerTwoSelectX > 0){
-							playerTwoSelectX -= 1;
-						}
-						break;
-					case RIGHT:
-						if(playerTwoSelectX < GRID_X - 1){
-							playerTwoSelectX += 1;
-						}
-						break;
-				}
-			}
-		}else if(moveSide == FIRST){
-			if(isPlayerOneSelecting){
-				tryMoveUnit(FIRST, playerOneSelectX, playerOneSelectY, moveDirection);
-			}else{
-				switch(moveDirection){
-					case UP:
-						if(playerOneSelectY > 0){
-							playerOneSelectY -= 1;
-						}
-						break;
-					case DOWN:
-						if(playerOneSelectY < GRID_Y - 1){
-							playerOneSelectY += 1;
-						}
-						break;
-					case LEFT:
-						if(playerOneSelectX > 0){
-							playerOneSelectX -= 1;
-						}
-						break;
-					case RIGHT:
-						if(playerOneSelectX < GRID_X - 1){
-							playerOneSelectX += 1;
-						}
-						break;
-				}
-			}
+		if(moveSide == FIRST){
+			pushInputEvent(INPUT_DIRECTION, moveSide, moveDirection, playerOnePressShift);
+		}else{
+			pushInputEvent(INPUT_DIRECTION, moveSide, moveDirection, playerTwoPressShift);
 		}
 	}
 }
@@ -488,244 +1009,780 @@ void ps2IrqHandler(){
 /* ↑↑↑ IRQ Handler ↑↑↑ */
 
 
+#ifdef ENABLE_PROFILER
+/* ↓↓↓ Profiler ↓↓↓ */
+//seven segment patterns of 0 to 9, bit n lights segment n
+const unsigned char hexDigits[10] = {0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F};
+
+void profileRecord(int stage, unsigned int cycles){
+	struct ProfileStage * p = &profile[stage];
+	if(p->count == 0 || cycles < p->min){
+		p->min = cycles;
+	}
+	if(cycles > p->max){
+		p->max = cycles;
+	}
+	p->total += cycles;
+	p->count += 1;
+}
+
+//moves the current window into the shown numbers and starts a new one
+void profilePublish(){
+	disableInterrupt();	//the handlers record into the same window
+	for(int i = 0; i < PROFILE_STAGES; i++){
+		struct ProfileStage * p = &profile[i];
+		p->shownMin = p->min;
+		p->shownAvg = (p->count > 0) ? p->total / p->count : 0;
+		p->shownMax = p->max;
+		p->shownCount = p->count;
+		p->min = 0;
+		p->max = 0;
+		p->total = 0;
+		p->count = 0;
+	}
+	enableInterrupt();
+}
+
+//the lowest digits of value as seven segment bytes, leading zeros stay dark
+unsigned int hexNumber(int value, int digits){
+	unsigned int segments = 0;
+	for(int i = 0; i < digits; i++){
+		segments |= hexDigits[value % 10] << (i * 8);
+		value /= 10;
+		if(value == 0) break;
+	}
+	return segments;
+}
+
+//called for every frame shown. once a window is full, HEX3-0 show the frames per second,
+//HEX5-4 the worst tick lag and LEDR9-4 the worst frame budget used, one led per sixth of a frame
+void profileFrame(){
+	profileFrames += 1;
+	profileLag = MAX(profileLag, tickLag);
+	profileBudget = MAX(profileBudget, frameBudgetUsed);
+	if(profileFrames < PROFILE_WINDOW) return;
+	
+	unsigned int now = halCounter();
+	unsigned int elapsed = now - profileWindowStart;
+	profileFps = (elapsed > 0) ? (int)((unsigned long long)profileFrames * CPU_HZ / elapsed) : 0;
+	profilePublish();
+	
+	halWrite32(HEX3_HEX0_BASE, hexNumber(MIN(profileFps, 9999), 4));
+	halWrite32(HEX5_HEX4_BASE, hexNumber(MIN(profileLag, 99), 2));
+	int leds = MIN((profileBudget * 6 + 99) / 100, 6);
+	halWrite32(LEDR_BASE, (halRead32(LEDR_BASE) & 0b1111) | (((1 << leds) - 1) << 4));
+	
+	profileWindowStart = now;
+	profileFrames = 0;
+	profileLag = 0;
+	profileBudget = 0;
+}
+/* ↑↑↑ Profiler ↑↑↑ */
+#endif
+
+
+/* ↓↓↓ Input Event Queue ↓↓↓ */
+//single producer (keyboard interrupt), single consumer (main loop) ring buffer,
+//each side only ever writes its own index so no locking is needed
+
+int pushInputEvent(int type, int side, int direction, int half){
+	unsigned int head = inputQueueHead;
+	if(head - inputQueueTail >= INPUT_QUEUE_SIZE){
+		droppedInputEvents += 1;
+		return false;
+	}
+	struct InputEvent * event = &inputQueue[head & (INPUT_QUEUE_SIZE - 1)];
+	event->tick = currentTrueTick;
+	event->type = type;
+	event->side = side;
+	event->direction = direction;
+	event->half = half;
+	__sync_synchronize();	//the event must be written before it is published
+	inputQueueHead = head + 1;
+	return true;
+}
+
+//returns the oldest event without removing it, or 0 if the queue is empty
+struct InputEvent * peekInputEvent(){
+	unsigned int tail = inputQueueTail;
+	if(tail == inputQueueHead) return 0;
+	__sync_synchronize();	//read the event only after seeing it published
+	return &inputQueue[tail & (INPUT_QUEUE_SIZE - 1)];
+}
+
+void popInputEvent(){
+	__sync_synchronize();	//done reading the slot before handing it back
+	inputQueueTail += 1;
+}
+
+void flushInputEvents(){
+	inputQueueTail = inputQueueHead;
+}
+
+/* ↑↑↑ Input Event Queue ↑↑↑ */
+
+
 ///////////////////////////
+#ifndef HOST_BUILD
 int main(void)
 {
 	irqSetupMain();
 	//printf("irq setup done\n");
-	while(1){
+	gameLoop();
+}
+#endif
+
+//never returns on the board, the emulator stops it after its last frame
+void gameLoop(){
+	buildSprites();
+	buildWaveTables();
+	while(halRunning()){
 		setup();
-		while(needInitialize == false){
+		//input and missed ticks keep being handled while a swap waits for the vertical sync,
+		//and a new frame is only drawn once the last one is on screen
+		while(needInitialize == false && halRunning()){
+			PROFILE_START(PROFILE_TICK);
 			doGameTick();
-			doRender();
+			PROFILE_END(PROFILE_TICK);
+			if(swapPending == false){
+				doRender();
+			}else{
+				swapFinished();
+			}
 		}
 	}
 }
 
 void setup(){
-	volatile int * IntervalTimerAddress = (int *) 0xff202000;
-	*(int *)(IntervalTimerAddress + 1) = 0b1011;
-	volatile int * A9TimerAddress = (int *)0xfffec600;
-	*(int *)(A9TimerAddress + 2) = 0b110;
-	*LEDAddress |= 0b1;
+	halWrite32(TIMER_BASE + 4, 0b1011);
+	halWrite32(MPCORE_PRIV_TIMER + 8, 0b110);
+	halWrite32(LEDR_BASE, halRead32(LEDR_BASE) | 0b1);
 	
 	//printf("setup start\n");
 	
 	initializeBuffer();
 	initializeRandomizer();
-	initializeBuffer();
+	fill_text_rect(0, 2, CHAR_BUF_WIDTH - 1, 3, ' ');	//remove the randomizer prompt
 	setupGrid();
 	drawHelp();
+	flushInputEvents();
 	gameEnded = false;
 	needInitialize = false;
 	//printf("setup done\n");
 	
-	*(int *)(IntervalTimerAddress + 1) = 0b0111;
-	*(int *)(A9TimerAddress + 2) = 0b111;
-	*LEDAddress |= 0b10;
+	halWrite32(TIMER_BASE + 4, 0b0111);
+	halWrite32(MPCORE_PRIV_TIMER + 8, 0b111);
+	halWrite32(LEDR_BASE, halRead32(LEDR_BASE) | 0b10);
 }
 //////////////////////////
 
-
-/* ↓↓↓ Game Logic ↓↓↓ */
-
 void initializeRandomizer(){
 	char* Text = "User input needed to generate data entropy";
 	renderText(2,2,Text);
 	Text = "Turn on and off switch 0 to generate random map";
 	renderText(2,3,Text);
-	volatile int * Switch_ptr = (int *) 0xff200040;
-	while(((*Switch_ptr) & 0b1) == 0){
-		get_random(1);
+	flushText();	//no frame is drawn while waiting
+	while((halRead32(SW_BASE) & 0b1) == 0){
+		randomSeed += 1;
+	}
+	while((halRead32(SW_BASE) & 0b1) == 1){
+		randomSeed += 1;
+	}
+}
+
+void setupGrid(){
+	currentTrueTick = 0;
+	tickLag = 0;
+	peakTickLag = 0;
+	laggingTicks = 0;
+	peakFrameBudgetUsed = 0;
+	totalFrameWorkCycles = 0;
+	budgetFrames = 0;
+	overBudgetFrames = 0;
+	frameStartCycles = halCycles();
+	animatingCount = 0;
+	bbReset(&animatingBoard);
+	animationCycles = timerCycles();
+	aiLastTick = 0;
+	gameInit(&game, GRID_X, GRID_Y, randomSeed);
+	replayStart(&currentReplay, GRID_X, GRID_Y, randomSeed);
+	centerCamera(FIRST);
+	markAllTilesDirty();
+}
+
+void doGameTick(){
+	////printf("Current Tick: %d / %d\n", game.tick, currentTrueTick);
+	
+	if(gameEnded == true){
+		flushInputEvents();
+		return;
+	}
+	
+	int trueTick = currentTrueTick;	//the timer interrupt keeps counting while we work
+	tickLag = trueTick - game.tick;
+	if(tickLag > peakTickLag){
+		peakTickLag = tickLag;
+	}
+	
+	//every call catches up fully, so it was more than one tick behind from the second tick after
+	//the last call until now
+	if(tickLag > 1){
+		laggingTicks += tickLag - 1;
 	}
-	while(((*Switch_ptr) & 0b1) == 1){
-		get_random(1);
+	
+	int owned[3];	//to hear what the input and the ticks changed
+	for(int side = FIRST; side <= SECOND; side++){
+		owned[side] = game.ownedCount[side];
+	}
+	int selected = false;
+	
+	//apply the queued input in order, each at the tick it arrived at
+	struct InputEvent * event = peekInputEvent();
+	while(event != 0 && event->tick <= trueTick && gameGetWinner(&game) == NONE){
+		if(event->tick > game.tick){
+			gameStep(&game, event->tick - game.tick);
+		}
+		gameApplyInput(&game, event);
+		if(event->type == INPUT_SELECT && game.isSelecting[(int)event->side]){
+			selected = true;	//select toggles, deselecting stays quiet
+		}
+		replayRecordInput(&currentReplay, game.tick, event);
+		popInputEvent();
+		event = peekInputEvent();
+	}
+	
+	if(game.tick < trueTick){
+		gameStep(&game, trueTick - game.tick);	//catch up on every missed tick at once
+	}
+	
+	//switch 1 hands the red side to the computer, switch 2 plays music
+	int switches = halRead32(SW_BASE);
+	updateMusic(switches & 0b100);
+	if((switches & 0b10) && game.tick != aiLastTick && gameGetWinner(&game) == NONE){
+		aiLastTick = game.tick;
+		struct AiMove move;
+#ifdef HOST_BUILD
+		aiChooseMove(&game, SECOND, AI_EMULATED_PLAYOUTS, 0, &move);
+#else
+		aiChooseMove(&game, SECOND, 0, (double)AI_BOARD_CYCLES / CPU_HZ, &move);
+#endif
+		if(move.direction != NONE){
+			struct InputEvent aiEvent;
+			aiEvent.tick = game.tick;
+			aiEvent.type = INPUT_MOVE;
+			aiEvent.side = SECOND;
+			aiEvent.direction = move.direction;
+			aiEvent.half = move.half;
+			aiEvent.x = move.x;
+			aiEvent.y = move.y;
+			gameApplyInput(&game, &aiEvent);
+			replayRecordInput(&currentReplay, game.tick, &aiEvent);
+		}
+	}
+	
+	//one effect at a time, a capture beats an expansion beats a selection
+	int sound = selected ? SOUND_SELECT : -1;
+	for(int side = FIRST; side <= SECOND; side++){
+		if(game.ownedCount[side] > owned[side]){
+			if(game.ownedCount[getOpponent(side)] < owned[getOpponent(side)]){
+				sound = SOUND_CAPTURE;
+			}else if(sound != SOUND_CAPTURE){
+				sound = SOUND_EXPAND;
+			}
+		}
+	}
+	if(sound != -1){
+		playSound(sound);
+	}
+	
+	if(gameGetWinner(&game) != NONE){
+		showWinningSide(gameGetWinner(&game));
+	}
+}
+#endif
+
+
+/* ↓↓↓ Bitboards ↓↓↓ */
+
+//clears every board and builds the edge masks for the map size of the state
+void initBitboards(struct GameState * state){
+	bbReset(&state->boardMask);
+	bbReset(&state->notLeftColumn);
+	bbReset(&state->notRightColumn);
+	bbReset(&state->mountainBoard);
+	bbReset(&state->baseBoard);
+	bbReset(&state->towerBoard);
+	bbReset(&state->producerBoard);
+	bbReset(&state->changedBoard);
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		state->producerWords[s] = 0;
+		state->changedWords[s] = 0;
+	}
+	for(int faction = NONE; faction <= SECOND; faction++){
+		bbReset(&state->ownedBoard[faction]);
+		state->ownedCount[faction] = 0;
+	}
+	state->ownedCount[NONE] = state->width * state->height;
+	for(int j = 0; j < state->height; j++){
+		for(int i = 0; i < state->width; i++){
+			bbSet(&state->boardMask, i, j);
+			bbSet(&state->ownedBoard[NONE], i, j);
+			if(i > 0){
+				bbSet(&state->notLeftColumn, i, j);
+			}
+			if(i < state->width - 1){
+				bbSet(&state->notRightColumn, i, j);
+			}
+		}
+	}
+}
+
+void bbReset(struct Bitboard * bb){
+	for(int w = 0; w < BB_WORDS; w++){
+		bb->word[w] = 0;
+	}
+}
+
+void bbSet(struct Bitboard * bb, int x, int y){
+	int index = y * GRID_X + x;
+	bb->word[index >> 6] |= 1ULL << (index & 63);
+}
+
+void bbClear(struct Bitboard * bb, int x, int y){
+	int index = y * GRID_X + x;
+	bb->word[index >> 6] &= ~(1ULL << (index & 63));
+}
+
+int bbTest(struct Bitboard * bb, int x, int y){
+	int index = y * GRID_X + x;
+	return (bb->word[index >> 6] >> (index & 63)) & 1;
+}
+
+//the index of the first set bit at or after from, -1 if there is none
+int bbNextSet(struct Bitboard * bb, int from){
+	int w = from >> 6;
+	if(w >= BB_WORDS) return -1;
+	unsigned long long bits = bb->word[w] & (~0ULL << (from & 63));
+	while(bits == 0){
+		w += 1;
+		if(w >= BB_WORDS) return -1;
+		bits = bb->word[w];
+	}
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+int bbAny(struct Bitboard bb){
+	unsigned long long any = 0;
+	for(int w = 0; w < BB_WORDS; w++){
+		any |= bb.word[w];
+	}
+	return any != 0;
+}
+
+struct Bitboard bbAnd(struct Bitboard a, struct Bitboard b){
+	for(int w = 0; w < BB_WORDS; w++){
+		a.word[w] &= b.word[w];
+	}
+	return a;
+}
+
+struct Bitboard bbOr(struct Bitboard a, struct Bitboard b){
+	for(int w = 0; w < BB_WORDS; w++){
+		a.word[w] |= b.word[w];
 	}
+	return a;
+}
+
+struct Bitboard bbAndNot(struct Bitboard a, struct Bitboard b){
+	for(int w = 0; w < BB_WORDS; w++){
+		a.word[w] &= ~b.word[w];
+	}
+	return a;
+}
+
+//moves every bit n places towards the higher indices, carrying across words
+struct Bitboard bbShiftHigher(struct Bitboard bb, int n){
+	struct Bitboard result;
+	int wordShift = n >> 6;
+	int bitShift = n & 63;
+	for(int w = BB_WORDS - 1; w >= 0; w--){
+		unsigned long long value = 0;
+		if(w - wordShift >= 0){
+			value = bb.word[w - wordShift] << bitShift;
+			if(bitShift != 0 && w - wordShift - 1 >= 0){
+				value |= bb.word[w - wordShift - 1] >> (64 - bitShift);
+			}
+		}
+		result.word[w] = value;
+	}
+	return result;
+}
+
+//moves every bit n places towards the lower indices, carrying across words
+struct Bitboard bbShiftLower(struct Bitboard bb, int n){
+	struct Bitboard result;
+	int wordShift = n >> 6;
+	int bitShift = n & 63;
+	for(int w = 0; w < BB_WORDS; w++){
+		unsigned long long value = 0;
+		if(w + wordShift < BB_WORDS){
+			value = bb.word[w + wordShift] >> bitShift;
+			if(bitShift != 0 && w + wordShift + 1 < BB_WORDS){
+				value |= bb.word[w + wordShift + 1] << (64 - bitShift);
+			}
+		}
+		result.word[w] = value;
+	}
+	return result;
+}
+
+//every tile next to a tile in the board, in the four move directions
+struct Bitboard bbNeighbours(struct GameState * state, struct Bitboard bb){
+	struct Bitboard result = bbShiftHigher(bbAnd(bb, state->notRightColumn), 1);	//right
+	result = bbOr(result, bbShiftLower(bbAnd(bb, state->notLeftColumn), 1));		//left
+	result = bbOr(result, bbShiftHigher(bb, GRID_X));								//down
+	result = bbOr(result, bbShiftLower(bb, GRID_X));								//up
+	return bbAnd(result, state->boardMask);
+}
+
+/* ↑↑↑ Bitboards ↑↑↑ */
+
+
+/* ↓↓↓ Game Logic ↓↓↓ */
+//everything in here only works on a GameState, so it runs the same on the board and on a host
+
+//pcg32, one per match so every seed gives the same map on the board and on a host
+unsigned int nextRandom(struct GameState * state){
+	unsigned long long old = state->randomState;
+	state->randomState = old * 6364136223846793005ULL + 1442695040888963407ULL;
+	unsigned int shifted = ((old >> 18) ^ old) >> 27;
+	unsigned int rotation = old >> 59;
+	return (shifted >> rotation) | (shifted << ((-rotation) & 31));
+}
+
+void seedRandom(struct GameState * state, unsigned int seed){
+	state->randomState = 0;
+	nextRandom(state);
+	state->randomState += seed;
+	nextRandom(state);
 }
 
-int get_random(int limit){
-	return rand() % (limit+1);
+//a number from 0 to limit, scaled with a multiply instead of a modulo
+int get_random(struct GameState * state, int limit){
+	return ((unsigned long long)nextRandom(state) * (unsigned int)(limit + 1)) >> 32;
 }
 
 int getDistance(int x1, int y1, int x2, int y2){
 	return ABS(x1 - x2) + ABS(y1 - y2);
 }
 
-void setupGrid(){
-	currentTrueTick = 0;
-	currentCalculatedTick = 0;
-	for(int i = 0; i < GRID_X; i++){
-		for(int j = 0; j < GRID_Y; j++){
-			unitCount[i][j] = 0;
-			animatedUnitCount[i][j] = unitCount[i][j];
-			int randomValue = get_random(100);
-			if(randomValue < 85){
-				gridTerrain[i][j] = EMPTY;
-			}else if(randomValue < 95){
-				gridTerrain[i][j] = MOUNTAIN;
+//generates a new map of the given size, at most GRID_X by GRID_Y and at least 2 by 2
+void gameInit(struct GameState * state, int width, int height, unsigned int seed){
+	state->width = width;
+	state->height = height;
+	state->tick = 0;
+	state->winner = NONE;
+	state->mapRepairs = 0;
+	seedRandom(state, seed);
+	initBitboards(state);
+	for(int j = 0; j < height; j++){
+		for(int i = 0; i < width; i++){
+			struct Tile * tile = getTile(state, i, j);
+			tile->unitCount = 0;
+			tile->animatedUnitCount = 0;
+			int randomValue = get_random(state, 99);
+			if(randomValue < EMPTY_CHANCE){
+				tile->terrain = EMPTY;
+			}else if(randomValue < EMPTY_CHANCE + MOUNTAIN_CHANCE){
+				tile->terrain = MOUNTAIN;
+				bbSet(&state->mountainBoard, i, j);
 			}else{
-				gridTerrain[i][j] = TOWER;
+				tile->terrain = TOWER;
+				bbSet(&state->towerBoard, i, j);
 			}
-			tileFaction[i][j] = NONE;
+			tile->faction = NONE;
 		}
 	}
-	int baseOneX = get_random(GRID_X-1);
-	int baseOneY = get_random(GRID_Y-1);
-	int baseTwoX = get_random(GRID_X-1);
-	int baseTwoY = get_random(GRID_Y-1);
-	while(getDistance(baseOneX, baseOneY, baseTwoX, baseTwoY) < ((GRID_X + GRID_Y)/2)){
-		baseTwoX = get_random(GRID_X-1);
-		baseTwoY = get_random(GRID_Y-1);
+	int baseOneX = get_random(state, width-1);
+	int baseOneY = get_random(state, height-1);
+	//the second base should be far away, after MAP_BASE_TRIES misses the farthest try is used
+	int baseTwoX = get_random(state, width-1);
+	int baseTwoY = get_random(state, height-1);
+	for(int attempt = 1; attempt < MAP_BASE_TRIES && getDistance(baseOneX, baseOneY, baseTwoX, baseTwoY) < ((width + height)/2); attempt++){
+		int x = get_random(state, width-1);
+		int y = get_random(state, height-1);
+		if(getDistance(baseOneX, baseOneY, x, y) > getDistance(baseOneX, baseOneY, baseTwoX, baseTwoY)){
+			baseTwoX = x;
+			baseTwoY = y;
+		}
 	}
 	
-	gridTerrain[baseOneX][baseOneY] = BASE;
-	gridTerrain[baseTwoX][baseTwoY] = BASE;
-	tileFaction[baseOneX][baseOneY] = FIRST;
-	tileFaction[baseTwoX][baseTwoY] = SECOND;
+	getTile(state, baseOneX, baseOneY)->terrain = BASE;
+	getTile(state, baseTwoX, baseTwoY)->terrain = BASE;
+	//the bases may have landed on a mountain or tower
+	bbClear(&state->mountainBoard, baseOneX, baseOneY);
+	bbClear(&state->mountainBoard, baseTwoX, baseTwoY);
+	bbClear(&state->towerBoard, baseOneX, baseOneY);
+	bbClear(&state->towerBoard, baseTwoX, baseTwoY);
+	bbSet(&state->baseBoard, baseOneX, baseOneY);
+	bbSet(&state->baseBoard, baseTwoX, baseTwoY);
+	state->homeBase[FIRST] = baseOneY * GRID_X + baseOneX;
+	state->homeBase[SECOND] = baseTwoY * GRID_X + baseTwoX;
+	setTileFaction(state, baseOneX, baseOneY, FIRST);
+	setTileFaction(state, baseTwoX, baseTwoY, SECOND);
+	state->mapRepairs = connectBases(state, baseOneX, baseOneY, baseTwoX, baseTwoY);
 	
-	playerOneSelectX = baseOneX;
-	playerOneSelectY = baseOneY;
+	state->cursorX[FIRST] = baseOneX;
+	state->cursorY[FIRST] = baseOneY;
 	
-	playerTwoSelectX = baseTwoX;
-	playerTwoSelectY = baseTwoY;
+	state->cursorX[SECOND] = baseTwoX;
+	state->cursorY[SECOND] = baseTwoY;
 	
-	isPlayerOneSelecting = false;
-	isPlayerTwoSelecting = false;
+	state->isSelecting[FIRST] = false;
+	state->isSelecting[SECOND] = false;
+	
+	state->changedBoard = state->boardMask;
+	for(int w = 0; w < (height * GRID_X + 63) / 64; w++){
+		state->changedWords[w >> 6] |= 1ULL << (w & 63);
+	}
 }
 
-void doGameTick(){
-	////printf("Current Tick: %d / %d\n", currentCalculatedTick, currentTrueTick);
-	
-	if(gameEnded == true) return;
-	
-	if(currentCalculatedTick < currentTrueTick){
+//flood fills around the mountains from one base, if the other base is not reached a path is
+//carved towards it from the closest reached tile. returns the amount of mountains removed
+int connectBases(struct GameState * state, int fromX, int fromY, int toX, int toY){
+	struct Bitboard open = bbAndNot(state->boardMask, state->mountainBoard);
+	struct Bitboard reached;
+	bbReset(&reached);
+	bbSet(&reached, fromX, fromY);
+	//every pass reaches at least one more tile, so this ends within width * height passes
+	while(true){
+		struct Bitboard next = bbAnd(bbOr(reached, bbNeighbours(state, reached)), open);
+		if(!bbAny(bbAndNot(next, reached))) break;
+		reached = next;
+	}
+	if(bbTest(&reached, toX, toY)) return 0;
 	
-		currentCalculatedTick += 1;	//do calculation if not keeping up yet
-
-		if(currentCalculatedTick % 4 == 0){
-			for(int i = 0; i < GRID_X; i++){
-				for(int j = 0; j < GRID_Y; j++){
-					if(tileFaction[i][j] != NONE){
-						if(gridTerrain[i][j] == BASE || gridTerrain[i][j] == TOWER){
-							if(unitCount[i][j] < MAX_UNIT){
-								unitCount[i][j] += 1;	
-							}
-						}
-					}
-				}
+	int x = fromX;
+	int y = fromY;
+	for(int w = 0; w < BB_WORDS; w++){
+		unsigned long long bits = reached.word[w];
+		while(bits){
+			int index = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			if(getDistance(index % GRID_X, index / GRID_X, toX, toY) < getDistance(x, y, toX, toY)){
+				x = index % GRID_X;
+				y = index / GRID_X;
 			}
 		}
 	}
+	int removed = 0;
+	while(x != toX || y != toY){
+		if(x != toX){
+			x += (toX > x) ? 1 : -1;
+		}else{
+			y += (toY > y) ? 1 : -1;
+		}
+		if(bbTest(&state->mountainBoard, x, y)){
+			bbClear(&state->mountainBoard, x, y);
+			getTile(state, x, y)->terrain = EMPTY;
+			removed += 1;
+		}
+	}
+	return removed;
 }
 
-void doAnimation(){
-	for(int i = 0; i < GRID_X; i++){
-		for(int j = 0; j < GRID_Y; j++){
-			if(animatedUnitCount[i][j] != unitCount[i][j]){
-				if(animatedUnitCount[i][j] > unitCount[i][j]){
-					animatedUnitCount[i][j] -= (((animatedUnitCount[i][j] - unitCount[i][j])/3 < 1) ? 1 : ((animatedUnitCount[i][j] - unitCount[i][j])/3));
-				}else{
-					animatedUnitCount[i][j] += (((unitCount[i][j] - animatedUnitCount[i][j])/3 < 1) ? 1 : ((unitCount[i][j] - animatedUnitCount[i][j])/3));
+//applies the given amount of ticks in one step,
+//production is deterministic so every producer gains its clamped total directly
+void gameStep(struct GameState * state, int ticks){
+	if(state->winner != NONE) return;
+	int endTick = state->tick + ticks;
+	int productions = endTick / PRODUCTION_INTERVAL - state->tick / PRODUCTION_INTERVAL;
+	state->tick = endTick;
+	if(productions <= 0) return;
+	
+	//only the words the summary points at are looked at, words whose producers were all lost leave it here
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		unsigned long long words = state->producerWords[s];
+		while(words){
+			int w = s * 64 + __builtin_ctzll(words);
+			words &= words - 1;
+			unsigned long long bits = state->producerBoard.word[w];
+			if(bits == 0){
+				state->producerWords[s] &= ~(1ULL << (w & 63));
+			}
+			while(bits){
+				int index = w * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				int i = index % GRID_X;
+				int j = index / GRID_X;
+				struct Tile * tile = getTile(state, i, j);
+				if(tile->unitCount < MAX_UNIT){
+					int gain = MAX_UNIT - tile->unitCount;
+					if(gain > productions){
+						gain = productions;
+					}
+					setTileUnitCount(state, i, j, tile->unitCount + gain);
 				}
 			}
 		}
 	}
 }
 
-void tryMoveUnit(int side, int x, int y, int direction){
-	if(gameEnded == true) return;
-	if(side == FIRST && isPlayerOneSelecting != true) return;
-	if(side == SECOND && isPlayerTwoSelecting != true) return;
-	if(tileFaction[x][y] != side) return;
-	if(unitCount[x][y] < 2) return;
+//moves all but one (or half) of the units on (x, y) one tile in the given direction,
+//returns true if anything moved
+int gameApplyMove(struct GameState * state, int side, int x, int y, int direction, int moveHalf){
+	if(state->winner != NONE) return false;
+	struct Tile * source = getTile(state, x, y);
+	if(source->faction != side) return false;
+	if(source->unitCount < 2) return false;
 	
 	int unitToMove = 0;
 	
-	if(side == FIRST && playerOnePressShift == true){
-		unitToMove = unitCount[x][y]/2;
-	}else if(side == SECOND && playerTwoPressShift == true){
-		unitToMove = unitCount[x][y]/2;
+	if(moveHalf == true){
+		unitToMove = source->unitCount/2;
 	}else{
-		unitToMove = unitCount[x][y] - 1;
+		unitToMove = source->unitCount - 1;
 	}
-	int unitRemain = unitCount[x][y] - unitToMove;
+	int unitRemain = source->unitCount - unitToMove;
 	
-	int targetX = -1;
-	int targetY = -1;
+	int targetX;
+	int targetY;
+	if(!getMoveTarget(state, x, y, direction, &targetX, &targetY)) return false;
+	if(bbTest(&state->mountainBoard, targetX, targetY)) return false;
+	struct Tile * target = getTile(state, targetX, targetY);
+	if(target->faction == side){
+		if((unitToMove + target->unitCount) > MAX_UNIT){
+			unitRemain += ((unitToMove + target->unitCount) - MAX_UNIT);
+			setTileUnitCount(state, targetX, targetY, MAX_UNIT);
+		}else{
+			setTileUnitCount(state, targetX, targetY, target->unitCount + unitToMove);
+		}
+	}else if(target->faction == NONE){
+		setTileFaction(state, targetX, targetY, side);
+		setTileUnitCount(state, targetX, targetY, unitToMove);
+	}else{
+		int defenderRemain = target->unitCount - unitToMove;	//the count can not go negative
+		if(defenderRemain == 0){
+			setTileFaction(state, targetX, targetY, NONE);
+			setTileUnitCount(state, targetX, targetY, 0);
+		}else if(defenderRemain < 0){
+			setTileFaction(state, targetX, targetY, side);
+			setTileUnitCount(state, targetX, targetY, 0 - defenderRemain);
+			//only taking a base from the other side wins, claiming one it lost to nobody does not
+			if(bbTest(&state->baseBoard, targetX, targetY)){
+				state->winner = side;
+			}
+		}else{
+			setTileUnitCount(state, targetX, targetY, defenderRemain);
+		}
+	}
+	setTileUnitCount(state, x, y, unitRemain);
+	return true;
+}
+
+//a select toggles unit selection, a direction either moves the cursor
+//or, while selecting, moves the selected units and the cursor follows them
+void gameApplyInput(struct GameState * state, struct InputEvent * event){
+	int side = event->side;
+	if(state->winner != NONE) return;
+	if(side != FIRST && side != SECOND) return;
 	
+	if(event->type == INPUT_SELECT){
+		state->isSelecting[side] = !state->isSelecting[side];
+	}else if(event->type == INPUT_DIRECTION){
+		if(state->isSelecting[side]){
+			int x = state->cursorX[side];
+			int y = state->cursorY[side];
+			if(gameApplyMove(state, side, x, y, event->direction, event->half)){
+				state->isSelecting[side] = false;
+				gameMoveCursor(state, side, event->direction);
+			}
+		}else{
+			gameMoveCursor(state, side, event->direction);
+		}
+	}else if(event->type == INPUT_MOVE){
+		if(gameApplyMove(state, side, event->x, event->y, event->direction, event->half)){
+			state->cursorX[side] = event->x;
+			state->cursorY[side] = event->y;
+			state->isSelecting[side] = false;
+			gameMoveCursor(state, side, event->direction);
+		}
+	}
+}
+
+int gameGetWinner(struct GameState * state){
+	return state->winner;
+}
+
+void gameMoveCursor(struct GameState * state, int side, int direction){
+	getMoveTarget(state, state->cursorX[side], state->cursorY[side], direction, &state->cursorX[side], &state->cursorY[side]);
+}
+
+//the neighbour of (x, y) in a direction, returns false if that is off the map
+int getMoveTarget(struct GameState * state, int x, int y, int direction, int * targetX, int * targetY){
 	switch(direction){
 		case UP:
 			if(y > 0){
-				targetY = y - 1;
-				targetX = x;
+				*targetY = y - 1;
+				*targetX = x;
+				return true;
 			}
 			break;
 		case DOWN:
-			if(y < GRID_Y - 1){
-				targetY = y + 1;
-				targetX = x;
+			if(y < state->height - 1){
+				*targetY = y + 1;
+				*targetX = x;
+				return true;
 			}
 			break;
 		case LEFT:
 			if(x > 0){
-				targetY = y;
-				targetX = x - 1;
+				*targetY = y;
+				*targetX = x - 1;
+				return true;
 			}
 			break;
 		case RIGHT:
-			if(x < GRID_X - 1){
-				targetY = y;
-				targetX = x + 1;
+			if(x < state->width - 1){
+				*targetY = y;
+				*targetX = x + 1;
+				return true;
 			}
 			break;
 	}
-	
-	if(targetX == -1 || targetY == -1) return;
-	if(gridTerrain[targetX][targetY] == MOUNTAIN) return;
-	int anythingDone = false;
-	if(tileFaction[targetX][targetY] == side){
-		if((unitToMove + unitCount[targetX][targetY]) > MAX_UNIT){
-			unitRemain += ((unitToMove + unitCount[targetX][targetY]) - MAX_UNIT);
-			unitCount[targetX][targetY] = MAX_UNIT;
-			unitCount[x][y] = unitRemain;
+	return false;
+}
+
+struct Tile * getTile(struct GameState * state, int x, int y){
+	return &state->tiles[y][x];
+}
+
+//keeps the owned and producer boards and their counts and summaries up to date
+void setTileFaction(struct GameState * state, int x, int y, int faction){
+	struct Tile * tile = getTile(state, x, y);
+	int index = y * GRID_X + x;
+	bbClear(&state->ownedBoard[tile->faction], x, y);
+	bbSet(&state->ownedBoard[faction], x, y);
+	state->ownedCount[tile->faction] -= 1;
+	state->ownedCount[faction] += 1;
+	if(tile->terrain == BASE || tile->terrain == TOWER){
+		if(faction == NONE){
+			bbClear(&state->producerBoard, x, y);
 		}else{
-			unitCount[targetX][targetY] += unitToMove;
-			unitCount[x][y] = unitRemain;
-		}
-		anythingDone = true;
-	}else if(tileFaction[targetX][targetY] == NONE){
-		tileFaction[targetX][targetY] = side;
-		unitCount[targetX][targetY] = unitToMove;
-		unitCount[x][y] = unitRemain;
-		anythingDone = true;
-	}else{
-		unitCount[targetX][targetY] -= unitToMove;
-		unitCount[x][y] = unitRemain;
-		if(unitCount[targetX][targetY] == 0){
-			tileFaction[targetX][targetY] = NONE;
-		}else if(unitCount[targetX][targetY] < 0){
-			tileFaction[targetX][targetY] = side;
-			unitCount[targetX][targetY] = (0 - unitCount[targetX][targetY]);
-		}
-		anythingDone = true;
-		if(gridTerrain[targetX][targetY] == BASE){
-			if(tileFaction[targetX][targetY] == side){
-				showWinningSide(side);
-			}
-		}
-	}
-	
-	if(anythingDone){
-		if(side == FIRST){
-			isPlayerOneSelecting = false;
-			playerOneSelectX = targetX;
-			playerOneSelectY = targetY;
-		}else if(side == SECOND){
-			isPlayerTwoSelecting = false;
-			playerTwoSelectX = targetX;
-			playerTwoSelectY = targetY;
+			bbSet(&state->producerBoard, x, y);
+			state->producerWords[index >> 12] |= 1ULL << ((index >> 6) & 63);
 		}
 	}
+	bbSet(&state->changedBoard, x, y);
+	state->changedWords[index >> 12] |= 1ULL << ((index >> 6) & 63);
+	tile->faction = faction;
+}
+
+void setTileUnitCount(struct GameState * state, int x, int y, int count){
+	int index = y * GRID_X + x;
+	getTile(state, x, y)->unitCount = count;
+	bbSet(&state->changedBoard, x, y);
+	state->changedWords[index >> 12] |= 1ULL << ((index >> 6) & 63);
 }
 
 int getMoveDirection(int keyCode){
@@ -747,76 +1804,770 @@ int getMoveDirection(int keyCode){
 }
 
 /* ↑↑↑ Game Logic ↑↑↑ */
-/* ↓↓↓ Audio ↓↓↓ */
-//note: due to the sim speed problem of CPULator,
-//audio cant be used for now
-/*
-#define SAMPLE_RATE 8000.0
-#define pi  3.141592
-	
-int currentFreq = 0;
-double curDuration = 0;
-int currentNote = 0;
-
-int currentSampleCount = 0;	//current location through one full wave
+/* ↓↓↓ Replay ↓↓↓ */
+//a replay is the header "GIOR", version, map width and height as varints and the 4 byte seed of gameInit,
+//then one entry per applied input: the ticks since the last entry as a varint and a byte of
+//type | side << 2 | direction << 4 | half << 7, INPUT_MOVE adds the tile x and y as varints.
+//an INPUT_END entry with the final tick closes it
 
-#define SONG_LENGTH 3
+void replayWriteByte(struct Replay * replay, int value){
+	if(replay->length >= REPLAY_BYTES){
+		replay->overflow = true;
+		return;
+	}
+	replay->data[replay->length] = value;
+	replay->length += 1;
+}
+
+void replayWriteVarint(struct Replay * replay, unsigned int value){
+	while(value >= 0x80){
+		replayWriteByte(replay, (value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	replayWriteByte(replay, value);
+}
+
+void replayStart(struct Replay * replay, int width, int height, unsigned int seed){
+	replay->length = 0;
+	replay->lastTick = 0;
+	replay->overflow = false;
+	replayWriteByte(replay, 'G');
+	replayWriteByte(replay, 'I');
+	replayWriteByte(replay, 'O');
+	replayWriteByte(replay, 'R');
+	replayWriteByte(replay, REPLAY_VERSION);
+	replayWriteVarint(replay, width);
+	replayWriteVarint(replay, height);
+	for(int i = 0; i < 4; i++){
+		replayWriteByte(replay, (seed >> (i * 8)) & 0xFF);
+	}
+}
+
+//tick is the tick the input was applied at, which can be later than the one it arrived at
+void replayRecordInput(struct Replay * replay, int tick, struct InputEvent * event){
+	if(replay->overflow) return;
+	replayWriteVarint(replay, tick - replay->lastTick);
+	replay->lastTick = tick;
+	replayWriteByte(replay, event->type | (event->side << 2) | (event->direction << 4) | (event->half << 7));
+	if(event->type == INPUT_MOVE){
+		replayWriteVarint(replay, event->x);
+		replayWriteVarint(replay, event->y);
+	}
+}
+
+void replayFinish(struct Replay * replay, int tick){
+	if(replay->overflow) return;
+	replayWriteVarint(replay, tick - replay->lastTick);
+	replay->lastTick = tick;
+	replayWriteByte(replay, INPUT_END);
+}
+
+int replayReadByte(struct ReplayReader * reader){
+	if(reader->position >= reader->length){
+		reader->error = true;
+		return 0;
+	}
+	reader->position += 1;
+	return reader->data[reader->position - 1];
+}
+
+unsigned int replayReadVarint(struct ReplayReader * reader){
+	unsigned int result = 0;
+	int shift = 0;
+	int value;
+	do{
+		value = replayReadByte(reader);
+		result |= (unsigned int)(value & 0x7F) << shift;
+		shift += 7;
+	}while((value & 0x80) && shift < 35);
+	return result;
+}
+
+//decodes the next entry into reader->next and reader->nextTick
+void replayReadEvent(struct ReplayReader * reader){
+	reader->nextTick += replayReadVarint(reader);
+	
+	int value = replayReadByte(reader);
+	reader->next.tick = reader->nextTick;
+	reader->next.type = value & 3;
+	reader->next.side = (value >> 2) & 3;
+	reader->next.direction = (value >> 4) & 7;
+	reader->next.half = (value >> 7) & 1;
+	if(reader->next.type == INPUT_MOVE){
+		reader->next.x = replayReadVarint(reader);
+		reader->next.y = replayReadVarint(reader);
+	}
+	if(reader->error){
+		reader->next.type = INPUT_END;
+	}
+}
+
+//checks the header and starts the match of the replay in state, returns false if it is not a replay
+int replayOpen(struct ReplayReader * reader, unsigned char * data, int length, struct GameState * state){
+	reader->data = data;
+	reader->length = length;
+	reader->position = 0;
+	reader->nextTick = 0;
+	reader->error = false;
+	if(replayReadByte(reader) != 'G' || replayReadByte(reader) != 'I' || replayReadByte(reader) != 'O' || replayReadByte(reader) != 'R') return false;
+	if(replayReadByte(reader) != REPLAY_VERSION) return false;
+	unsigned int width = replayReadVarint(reader);
+	unsigned int height = replayReadVarint(reader);
+	unsigned int seed = 0;
+	for(int i = 0; i < 4; i++){
+		seed |= (unsigned int)replayReadByte(reader) << (i * 8);
+	}
+	if(reader->error || width < 2 || width > GRID_X || height < 2 || height > GRID_Y) return false;
+	gameInit(state, width, height, seed);
+	replayReadEvent(reader);
+	return true;
+}
+
+//plays the replay up to the given tick, returns false once its end is reached
+int replayAdvance(struct ReplayReader * reader, struct GameState * state, int untilTick){
+	while(reader->nextTick <= untilTick){
+		if(reader->nextTick > state->tick){
+			gameStep(state, reader->nextTick - state->tick);
+		}
+		if(reader->next.type == INPUT_END) return false;
+		gameApplyInput(state, &reader->next);
+		replayReadEvent(reader);
+	}
+	if(untilTick > state->tick){
+		gameStep(state, untilTick - state->tick);
+	}
+	return true;
+}
+
+//fnv-1a over everything a replay has to reproduce, to compare two runs
+unsigned int gameHash(struct GameState * state){
+	unsigned int hash = 2166136261u;
+	for(int j = 0; j < state->height; j++){
+		for(int i = 0; i < state->width; i++){
+			struct Tile * tile = getTile(state, i, j);
+			hash = (hash ^ tile->unitCount) * 16777619u;
+			hash = (hash ^ (tile->terrain | (tile->faction << 2))) * 16777619u;
+		}
+	}
+	hash = (hash ^ state->tick) * 16777619u;
+	hash = (hash ^ state->winner) * 16777619u;
+	return hash;
+}
+
+/* ↑↑↑ Replay ↑↑↑ */
+/* ↓↓↓ Snapshots ↓↓↓ */
+//a GameState holds the whole match in one block, so saving a tick is a single memcpy into a frame of the ring.
+//the ring is allocated with its owner, restoring a tick drops every frame saved after it
+
+//rows below the map are never read, so they are left out of the copy
+int snapshotBytes(struct GameState * state){
+	return offsetof(struct GameState, tiles) + state->height * sizeof(state->tiles[0]);
+}
+
+void snapshotReset(struct SnapshotRing * ring){
+	ring->newest = SNAPSHOT_FRAMES - 1;
+	ring->count = 0;
+}
+
+//overwrites the oldest frame once the ring is full
+void snapshotSave(struct SnapshotRing * ring, struct GameState * state){
+	ring->newest = (ring->newest + 1) % SNAPSHOT_FRAMES;
+	memcpy(&ring->frame[ring->newest], state, snapshotBytes(state));
+	if(ring->count < SNAPSHOT_FRAMES){
+		ring->count += 1;
+	}
+}
+
+//puts the state back to the saved frame of a tick, false if that tick is not in the ring
+int snapshotRestore(struct SnapshotRing * ring, struct GameState * state, int tick){
+	for(int i = 0; i < ring->count; i++){
+		int index = (ring->newest - i + SNAPSHOT_FRAMES) % SNAPSHOT_FRAMES;
+		struct GameState * frame = &ring->frame[index];
+		if(frame->tick == tick){
+			memcpy(state, frame, snapshotBytes(frame));
+			ring->newest = index;
+			ring->count -= i;
+			return true;
+		}
+	}
+	return false;
+}
+
+//the earliest tick that can still be restored, -1 if nothing was saved
+int snapshotOldestTick(struct SnapshotRing * ring){
+	if(ring->count == 0) return -1;
+	return ring->frame[(ring->newest - ring->count + 1 + SNAPSHOT_FRAMES) % SNAPSHOT_FRAMES].tick;
+}
+
+/* ↑↑↑ Snapshots ↑↑↑ */
+/* ↓↓↓ Computer Player ↓↓↓ */
+//monte carlo tree search over the real move and production rules: the searching side moves,
+//the other side answers, then AI_TICKS_PER_ROUND ticks pass. on a host every thread searches
+//its own tree from the same position and the root visits of all trees are added up
+
+#ifdef HOST_BUILD
+struct AiSearch * aiSearches;	//one tree per thread, aiChooseMove allocates them the first time it needs more
+int aiSearchCount;
+#else
+struct AiSearch aiSearches[AI_MAX_THREADS];
+#endif
+int aiThreadCount = 1;
+
+int getOpponent(int side){
+	return (side == FIRST) ? SECOND : FIRST;
+}
+
+//xorshift, every search has its own so the threads never share one
+int aiRandom(unsigned int * seed, int limit){
+	unsigned int x = *seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x % limit;
+}
+
+//steps move on to the next legal move of the side, tile by tile, then by direction, then by half.
+//start it from a pass, returns false after the last move
+int aiNextMove(struct GameState * state, int side, struct AiMove * move){
+	struct Bitboard * owned = &state->ownedBoard[side];
+	int index;
+	int direction;
+	int half;
+	if(move->direction == NONE){
+		index = bbNextSet(owned, 0);
+		direction = UP;
+		half = false;
+	}else{
+		index = move->y * GRID_X + move->x;
+		direction = move->direction;
+		half = move->half + 1;
+	}
+	while(index != -1){
+		int x = index % GRID_X;
+		int y = index / GRID_X;
+		int units = getTile(state, x, y)->unitCount;
+		if(units >= 2){
+			for(; direction <= RIGHT; direction++, half = false){
+				int targetX;
+				int targetY;
+				if(!getMoveTarget(state, x, y, direction, &targetX, &targetY)) continue;
+				if(bbTest(&state->mountainBoard, targetX, targetY)) continue;
+				if(half > 1 || (half && units < 3)) continue;	//with 2 units both halves move 1
+				move->x = x;
+				move->y = y;
+				move->direction = direction;
+				move->half = half;
+				return true;
+			}
+		}
+		index = bbNextSet(owned, index + 1);
+		direction = UP;
+		half = false;
+	}
+	return false;
+}
+
+void aiPassMove(struct AiMove * move){
+	move->x = 0;
+	move->y = 0;
+	move->direction = NONE;
+	move->half = false;
+}
 
-int songNote[SONG_LENGTH] = {1000, 800, 1200};
-double noteDuration[SONG_LENGTH] = {1, 1, 1};
+int aiPlayMove(struct GameState * state, int side, struct AiMove * move){
+	if(move->direction == NONE) return false;
+	return gameApplyMove(state, side, move->x, move->y, move->direction, move->half);
+}
+
+//1 for a won match, 0 for a lost one, otherwise the share of units, tiles and producers
+float aiEvaluate(struct GameState * state, int side){
+	int winner = gameGetWinner(state);
+	if(winner != NONE){
+		return (winner == side) ? 1.0f : 0.0f;
+	}
+	struct Bitboard * producers = &state->producerBoard;
+	int strength[3] = {0, 0, 0};
+	int words = (state->height * GRID_X + 63) / 64;	//the rest of the boards is off the map
+	for(int faction = FIRST; faction <= SECOND; faction++){
+		//tiles closer to the base of the other side are worth more, so the search makes progress
+		int target = state->homeBase[getOpponent(faction)];
+		int reach = state->width + state->height;
+		for(int w = 0; w < words; w++){
+			unsigned long long bits = state->ownedBoard[faction].word[w];
+			strength[faction] += 10 * __builtin_popcountll(bits & producers->word[w]);
+			while(bits){
+				int index = w * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				int x = index % GRID_X;
+				int y = index / GRID_X;
+				strength[faction] += getTile(state, x, y)->unitCount + 2;
+				strength[faction] += (reach - getDistance(x, y, target % GRID_X, target / GRID_X)) / 4;
+			}
+		}
+	}
+	int mine = strength[side];
+	int theirs = strength[getOpponent(side)];
+	return 0.5f + 0.5f * (mine - theirs) / (float)(mine + theirs + 1);
+}
+
+//picks a random tile of the side and moves it in a random direction,
+//returns true if the move was legal
+int playRandomMove(struct GameState * state, int side){
+	struct Bitboard * owned = &state->ownedBoard[side];
+	int count = state->ownedCount[side];
+	if(count == 0) return false;
+	
+	int pick = get_random(state, count - 1);
+	for(int w = 0; w < BB_WORDS; w++){
+		int inWord = __builtin_popcountll(owned->word[w]);
+		if(pick >= inWord){
+			pick -= inWord;
+			continue;
+		}
+		unsigned long long bits = owned->word[w];
+		while(pick > 0){
+			bits &= bits - 1;
+			pick -= 1;
+		}
+		int index = w * 64 + __builtin_ctzll(bits);
+		int direction = get_random(state, 3) + UP;
+		return gameApplyMove(state, side, index % GRID_X, index / GRID_X, direction, get_random(state, 1));
+	}
+	return false;
+}
+
+//one turn of the search model, time passes once the answer of the other side is in
+void aiPlayTurn(struct AiSearch * search, struct GameState * state, int side, struct AiMove * move){
+	aiPlayMove(state, side, move);
+	if(side != search->side){
+		gameStep(state, AI_TICKS_PER_ROUND);
+	}
+}
 
-void writeAudio(double freq, int samplesToGenerate){
+//gives the node a child for every legal move, the pass first,
+//returns false when the pool has no room left
+int aiExpand(struct AiSearch * search, int nodeIndex, struct GameState * state, int side){
+	struct AiMove move;
+	aiPassMove(&move);
+	int count = 0;
+	do{
+		if(search->nodeCount + count >= AI_NODE_POOL) return false;
+		struct AiNode * child = &search->nodes[search->nodeCount + count];
+		child->parent = nodeIndex;
+		child->firstChild = -1;
+		child->childCount = 0;
+		child->visits = 0;
+		child->score = 0;
+		child->move = move;
+		child->mover = side;
+		count += 1;
+	}while(aiNextMove(state, side, &move));
 	
-	volatile int * AudioAddress = (int *) 0xff203040;
+	struct AiNode * node = &search->nodes[nodeIndex];
+	node->firstChild = search->nodeCount;
+	node->childCount = count;
+	search->nodeCount += count;
+	return true;
+}
+
+//uct, every child is tried once before any is tried twice. unvisited children are tried
+//from a random start so the trees of the threads differ
+int aiSelectChild(struct AiSearch * search, int nodeIndex){
+	struct AiNode * node = &search->nodes[nodeIndex];
+	if(node->visits <= node->childCount){
+		int start = aiRandom(&search->seed, node->childCount);
+		for(int i = 0; i < node->childCount; i++){
+			int child = node->firstChild + (start + i) % node->childCount;
+			if(search->nodes[child].visits == 0) return child;
+		}
+	}
+	float logVisits = logf(node->visits + 1);
+	int best = node->firstChild;
+	float bestValue = -1;
+	for(int i = node->firstChild; i < node->firstChild + node->childCount; i++){
+		struct AiNode * child = &search->nodes[i];
+		float value = child->score / child->visits + AI_EXPLORATION * sqrtf(logVisits / child->visits);
+		if(value > bestValue){
+			bestValue = value;
+			best = i;
+		}
+	}
+	return best;
+}
+
+void aiRunSearch(struct AiSearch * search){
+	struct AiNode * root = &search->nodes[0];
+	root->parent = -1;
+	root->firstChild = -1;
+	root->childCount = 0;
+	root->visits = 0;
+	root->score = 0;
+	root->mover = getOpponent(search->side);
+	search->nodeCount = 1;
+	search->playoutsDone = 0;
+	seedRandom(&search->root, search->seed);	//rollouts draw from the match generator, give every tree its own
+	aiExpand(search, 0, &search->root, search->side);
+	
+	struct GameState state;
+	while(search->playoutsDone < search->playouts){
+#ifdef HOST_BUILD
+		if(search->deadline > 0 && (search->playoutsDone & 15) == 0 && getSeconds() >= search->deadline) break;
+#elif !defined(GENERAL_LIBRARY)
+		//a playout takes far longer than reading the timer, and the first one always runs so there is a move
+		if(search->budgetCycles > 0 && search->playoutsDone > 0 && halCycles() - search->startCycles >= search->budgetCycles) break;
+#endif
+		state = search->root;
+		int nodeIndex = 0;
+		int side = search->side;
+		
+		//walk down the tree
+		while(search->nodes[nodeIndex].childCount > 0 && gameGetWinner(&state) == NONE){
+			nodeIndex = aiSelectChild(search, nodeIndex);
+			aiPlayTurn(search, &state, side, &search->nodes[nodeIndex].move);
+			side = getOpponent(side);
+		}
+		
+		//grow it by one level once a leaf was visited before
+		if(gameGetWinner(&state) == NONE && search->nodes[nodeIndex].visits > 0 && aiExpand(search, nodeIndex, &state, side)){
+			nodeIndex = search->nodes[nodeIndex].firstChild;
+			aiPlayTurn(search, &state, side, &search->nodes[nodeIndex].move);
+			side = getOpponent(side);
+		}
+		
+		//random playout
+		for(int turn = 0; turn < AI_ROLLOUT_ROUNDS * 2 && gameGetWinner(&state) == NONE; turn++){
+			playRandomMove(&state, side);
+			if(side != search->side){
+				gameStep(&state, AI_TICKS_PER_ROUND);
+			}
+			side = getOpponent(side);
+		}
+		
+		float result = aiEvaluate(&state, search->side);
+		while(nodeIndex != -1){
+			struct AiNode * node = &search->nodes[nodeIndex];
+			node->visits += 1;
+			node->score += (node->mover == search->side) ? result : 1.0f - result;
+			nodeIndex = node->parent;
+		}
+		search->playoutsDone += 1;
+	}
+}
+
+#ifdef HOST_BUILD
+void * aiSearchThread(void * argument){
+	aiRunSearch((struct AiSearch *)argument);
+	return 0;
+}
+#endif
+
+//searches for the given playouts or seconds, whichever ends first, and stores
+//the most visited move in best, returns the playouts done over all threads
+int aiChooseMove(struct GameState * state, int side, int playouts, double seconds, struct AiMove * best){
+#ifdef HOST_BUILD
+	if(aiSearchCount < aiThreadCount){
+		free(aiSearches);
+		aiSearches = malloc(aiThreadCount * sizeof(struct AiSearch));
+		aiSearchCount = aiThreadCount;
+	}
+#endif
+	return aiSearchMove(aiSearches, aiThreadCount, state, side, playouts, seconds, best);
+}
+
+//the same with trees of the caller, one per thread, for callers that search from several threads at once
+int aiSearchMove(struct AiSearch * searches, int threads, struct GameState * state, int side, int playouts, double seconds, struct AiMove * best){
+	double deadline = 0;
+	unsigned int startCycles = 0;
+	unsigned int budgetCycles = 0;
+#ifdef HOST_BUILD
+	if(seconds > 0){
+		deadline = getSeconds() + seconds;
+	}
+#elif !defined(GENERAL_LIBRARY)
+	if(seconds > 0){
+		startCycles = halCycles();
+		budgetCycles = (unsigned int)(seconds * CPU_HZ);
+	}
+#else
+	//the core alone has no clock, only the playouts limit it
+	seconds = 0;
+#endif
+	if(playouts <= 0){
+		playouts = (seconds > 0) ? 0x7FFFFFFF : 1;
+	}
+	for(int t = 0; t < threads; t++){
+		struct AiSearch * search = &searches[t];
+		search->root = *state;
+		search->side = side;
+		search->playouts = (playouts == 0x7FFFFFFF) ? playouts : (playouts + threads - 1) / threads;
+		search->deadline = deadline;
+		search->startCycles = startCycles;
+		search->budgetCycles = budgetCycles;
+		search->seed = ((unsigned int)state->randomState ^ (state->tick * 0x9E3779B9u)) + t * 0x85EBCA6Bu + 1;
+		if(search->seed == 0) search->seed = 1;
+	}
+#ifdef HOST_BUILD
+	pthread_t thread[AI_MAX_THREADS];
+	for(int t = 1; t < threads; t++){
+		pthread_create(&thread[t], 0, aiSearchThread, &searches[t]);
+	}
+	aiRunSearch(&searches[0]);
+	for(int t = 1; t < threads; t++){
+		pthread_join(thread[t], 0);
+	}
+#else
+	aiRunSearch(&searches[0]);
+#endif
 	
-	int vol = 0x0FFFFFFF;
+	//every tree expanded its root from the same position, so the children line up
+	struct AiNode * root = &searches[0].nodes[0];
+	int bestChild = root->firstChild;
+	int bestVisits = -1;
+	for(int i = root->firstChild; i < root->firstChild + root->childCount; i++){
+		int visits = 0;
+		for(int t = 0; t < threads; t++){
+			visits += searches[t].nodes[i].visits;
+		}
+		if(visits > bestVisits){
+			bestVisits = visits;
+			bestChild = i;
+		}
+	}
+	*best = searches[0].nodes[bestChild].move;
 	
-	for(int i = currentSampleCount; i < currentSampleCount+samplesToGenerate; i++){
-		*(int *)(AudioAddress + 2) = vol * sin(2*pi*i*freq/SAMPLE_RATE);
-		*(int *)(AudioAddress + 3) = vol * sin(2*pi*i*freq/SAMPLE_RATE);
+	int total = 0;
+	for(int t = 0; t < threads; t++){
+		total += searches[t].playoutsDone;
+	}
+	return total;
+}
+
+//the baseline the search is measured against, the move that looks best right after it is made
+void aiGreedyMove(struct GameState * state, int side, struct AiMove * best){
+	struct AiMove move;
+	aiPassMove(&move);
+	float bestValue = -1;
+	do{
+		struct GameState next = *state;
+		aiPlayMove(&next, side, &move);
+		float value = aiEvaluate(&next, side);
+		if(value > bestValue){
+			bestValue = value;
+			*best = move;
+		}
+	}while(aiNextMove(state, side, &move));
+}
+
+/* ↑↑↑ Computer Player ↑↑↑ */
+#ifndef GENERAL_LIBRARY
+/* ↓↓↓ Audio ↓↓↓ */
+//voices read integer wavetables through 32 bit phase accumulators, so a sample costs a table
+//read, a multiply and two adds per playing voice. the audio interrupt mixes a whole fifo
+//refill at once, and is switched off while nothing plays
+signed char waveTables[WAVE_COUNT][WAVE_SIZE];
+struct Voice voices[AUDIO_VOICES];
+
+//frequencies in hz and lengths in ms, a frequency of 0 is a rest and a length of 0 ends the sound
+const struct Note selectNotes[] = {{880, 30}, {0, 0}};
+const struct Note expandNotes[] = {{660, 25}, {0, 0}};
+const struct Note captureNotes[] = {{523, 40}, {784, 70}, {0, 0}};
+const struct Note winNotes[] = {{523, 120}, {659, 120}, {784, 120}, {1047, 400}, {0, 0}};
+const struct Note musicNotes[] = {{131, 250}, {165, 250}, {196, 250}, {165, 250},
+	{110, 250}, {131, 250}, {165, 250}, {131, 250}, {0, 0}};
+
+const struct Sound sounds[SOUND_COUNT] = {
+	{WAVE_SQUARE, 50, selectNotes},
+	{WAVE_TRIANGLE, 90, expandNotes},
+	{WAVE_SQUARE, 70, captureNotes},
+	{WAVE_SQUARE, 90, winNotes},
+	{WAVE_TRIANGLE, 60, musicNotes},
+};
+
+void buildWaveTables(){
+	unsigned int noise = 0xACE1;
+	for(int i = 0; i < WAVE_SIZE; i++){
+		int half = i % (WAVE_SIZE / 2);
+		int sign = (i < WAVE_SIZE / 2) ? 1 : -1;
+		waveTables[WAVE_SQUARE][i] = sign * 127;
+		waveTables[WAVE_TRIANGLE][i] = ((i < WAVE_SIZE / 2) ? i : WAVE_SIZE - 1 - i) * 2 - 127;
+		//a parabola per half period is close enough to a sine for a chiptune
+		waveTables[WAVE_SINE][i] = sign * half * (WAVE_SIZE / 2 - half) * 127 / (WAVE_SIZE * WAVE_SIZE / 16);
+		noise = (noise >> 1) ^ (-(noise & 1) & 0xB400);
+		waveTables[WAVE_NOISE][i] = (int)(noise & 0xFF) - 128;
 	}
-	currentSampleCount += samplesToGenerate;
-	if(currentSampleCount > SAMPLE_RATE){
-		currentSampleCount -= SAMPLE_RATE;	
+}
+
+//moves a voice to its next note, or frees it after the last one unless it loops
+void startNote(struct Voice * voice){
+	if(voice->note->length == 0){
+		if(!voice->loop){
+			voice->note = 0;
+			return;
+		}
+		voice->note = voice->sound->notes;
 	}
+	voice->step = (unsigned int)(((unsigned long long)voice->note->frequency << 32) / AUDIO_RATE);
+	voice->samplesLeft = voice->note->length * AUDIO_RATE / 1000;
+	voice->level = (voice->note->frequency > 0) ? voice->sound->volume << 16 : 0;
+	voice->decay = voice->level / 2 / voice->samplesLeft;	//notes fade to half their volume
 }
 
-void generateChipTune(){
-	unsigned int fifospace;
-	volatile int * audio_ptr = (int *) 0xFF203040; // audio port
-	fifospace = *(audio_ptr+1);
-	while((fifospace & 0x00FF0000) > 0){
-		if(curDuration<=0){
-			currentNote+=1;
-			if(currentNote >= SONG_LENGTH){
-				currentNote = 0;
+//adds count samples of every playing voice into out
+void mixAudio(int * out, int count){
+	for(int i = 0; i < count; i++){
+		out[i] = 0;
+	}
+	for(int v = 0; v < AUDIO_VOICES; v++){
+		struct Voice * voice = &voices[v];
+		int i = 0;
+		while(voice->note != 0 && i < count){
+			const signed char * table = waveTables[voice->sound->wave];
+			unsigned int phase = voice->phase;
+			unsigned int step = voice->step;
+			int level = voice->level;
+			int decay = voice->decay;
+			int run = MIN(count - i, voice->samplesLeft);
+			for(int n = 0; n < run; n++){
+				out[i + n] += table[phase >> (32 - WAVE_BITS)] * (level >> 16);
+				phase += step;
+				level -= decay;
+			}
+			i += run;
+			voice->phase = phase;
+			voice->level = level;
+			voice->samplesLeft -= run;
+			if(voice->samplesLeft == 0){
+				voice->note += 1;
+				startNote(voice);
 			}
-			currentFreq = songNote[currentNote];
-			curDuration = noteDuration[currentNote];
 		}
-		int spaceAvailable = ((fifospace & 0x00FF0000) >> 16);
-		writeAudio(currentFreq, spaceAvailable);
-		curDuration -= (spaceAvailable/SAMPLE_RATE);
-		fifospace = *(audio_ptr+1);
 	}
-}*/
+}
+
+int audioPlaying(){
+	for(int v = 0; v < AUDIO_VOICES; v++){
+		if(voices[v].note != 0) return true;
+	}
+	return false;
+}
+
+void startVoice(struct Voice * voice, int sound, int loop){
+	disableInterrupt();	//the audio interrupt mixes the same voices
+	voice->sound = &sounds[sound];
+	voice->note = voice->sound->notes;
+	voice->loop = loop;
+	voice->phase = 0;
+	startNote(voice);
+	enableInterrupt();
+	halWrite32(AUDIO_BASE, 0b10);	//the fifo asks for samples again
+}
+
+//effects take a free effect voice, or the one closest to finishing
+void playSound(int sound){
+	struct Voice * best = &voices[MUSIC_VOICE + 1];
+	for(int v = MUSIC_VOICE + 1; v < AUDIO_VOICES; v++){
+		if(voices[v].note == 0){
+			best = &voices[v];
+			break;
+		}
+		if(voices[v].samplesLeft < best->samplesLeft){
+			best = &voices[v];
+		}
+	}
+	startVoice(best, sound, false);
+}
+
+void updateMusic(int on){
+	struct Voice * voice = &voices[MUSIC_VOICE];
+	if(on && voice->note == 0){
+		startVoice(voice, SOUND_MUSIC, true);
+	}else if(!on && voice->note != 0){
+		disableInterrupt();	//the audio interrupt mixes the same voices
+		voice->note = 0;
+		enableInterrupt();
+	}
+}
+
+//fills the free fifo space of both channels with the same mix
+void AudioIrqHandler(){
+	int samples[AUDIO_FIFO_SIZE];
+	int space = halRead32(AUDIO_BASE + 4);
+	int count = MIN((space >> 24) & 0xFF, (space >> 16) & 0xFF);
+	mixAudio(samples, count);
+	for(int i = 0; i < count; i++){
+		halWrite32(AUDIO_BASE + 8, samples[i] * (1 << AUDIO_SHIFT));	//mixes are often negative, which a shift can not take
+		halWrite32(AUDIO_BASE + 12, samples[i] * (1 << AUDIO_SHIFT));
+	}
+	if(!audioPlaying()){
+		halWrite32(AUDIO_BASE, 0);	//what is queued still plays out
+	}
+}
 /* ↑↑↑ Audio ↑↑↑ */
+
 /* ↓↓↓ Rendering ↓↓↓ */
 void doRender(){
+	updateCamera();
+	framePixelWrites = 0;
+	frameCharWrites = 0;
+	collectChangedTiles();
+	PROFILE_START(PROFILE_ANIMATION);
 	doAnimation();
-	volatile int * pixel_ctrl_ptr = (int *)0xFF203020;
-	drawGrid();
+	PROFILE_END(PROFILE_ANIMATION);
+	
+	PROFILE_START(PROFILE_HIGHLIGHTS);
+	wantedHighlightCount = 0;
 	drawSelection(FIRST);
 	drawSelection(SECOND);
 	
-	if(isPlayerOneSelecting){
+	if(game.isSelecting[FIRST]){
 		flashHighlight(FIRST);
 	}
-	if(isPlayerTwoSelecting){
+	if(game.isSelecting[SECOND]){
 		flashHighlight(SECOND);
 	}
-	wait_sync();
-	pixel_buffer_start = *(pixel_ctrl_ptr + 1);
+	PROFILE_END(PROFILE_HIGHLIGHTS);
+	
+	//only what changed since this buffer was last shown gets erased and repainted
+	int buffer = getBackBufferIndex();
+	scrollBuffer(buffer);
+	int highlightChanged = updateHighlights(buffer);
+	drawHud();
+	
+	PROFILE_START(PROFILE_GRID);
+	int tilesDrawn = drawGrid();
+	PROFILE_END(PROFILE_GRID);
+	if(tilesDrawn > 0 || highlightChanged){
+		//repainted tiles may have cut through the highlights, put all of them back on top
+		for(int i = 0; i < wantedHighlightCount; i++){
+			int tile = wantedHighlight[i] >> 2;
+			drawHighlight(tile % GRID_X, tile / GRID_X, wantedHighlight[i] & 3);
+			drawnHighlight[buffer][i] = wantedHighlight[i];
+		}
+		drawnHighlightCount[buffer] = wantedHighlightCount;
+	}
+	framePixelWritesSaved = fullRedrawPixelWrites() - framePixelWrites;
+	flushText();
+	frameCharWritesSaved = textCharsWritten - frameCharWrites;
+	textCharsWritten = 0;
+	totalPixelWritesSaved += framePixelWritesSaved;
+	totalCharWritesSaved += frameCharWritesSaved;
+	
+	frameWorkCycles = halCycles() - frameStartCycles;
+	frameBudgetUsed = (int)((long long)frameWorkCycles * 100 / FRAME_CYCLES);
+	if(frameBudgetUsed > peakFrameBudgetUsed){
+		peakFrameBudgetUsed = frameBudgetUsed;
+	}
+	if(frameWorkCycles > FRAME_CYCLES){
+		overBudgetFrames += 1;
+	}
+	totalFrameWorkCycles += frameWorkCycles;
+	budgetFrames += 1;
+	
+	//the frame is ready, it is shown at the next vertical sync without waiting for it here
+	halWrite32(PIXEL_BUF_CTRL_BASE, 1);
+	swapPending = true;
+	PROFILE_START(PROFILE_SYNC);
 }
 
 void renderText(int x, int y, char* text){
@@ -841,192 +2592,467 @@ void showWinningSide(int side){
 	y = 59;
 	x = 2;
 	renderText(x, y, winText);
+	playSound(SOUND_WIN);
 	gameEnded = true;
 }
 
+//only writes the parts of the hud whose value changed since it was last written
+void drawHud(){
+	if(hudTick < 0){
+		renderText(8, HUD_ROW, "Tick");
+		renderText(22, HUD_ROW, "Blue");
+		renderText(33, HUD_ROW, "tiles");
+		renderText(41, HUD_ROW, "Red");
+		renderText(51, HUD_ROW, "tiles");
+		hudOwned[FIRST] = -1;
+		hudOwned[SECOND] = -1;
+	}
+	if(game.tick != hudTick){
+		renderNumber(13, HUD_ROW, game.tick, 6);
+		hudTick = game.tick;
+	}
+	if(game.ownedCount[FIRST] != hudOwned[FIRST]){
+		renderNumber(27, HUD_ROW, game.ownedCount[FIRST], 5);
+		hudOwned[FIRST] = game.ownedCount[FIRST];
+	}
+	if(game.ownedCount[SECOND] != hudOwned[SECOND]){
+		renderNumber(45, HUD_ROW, game.ownedCount[SECOND], 5);
+		hudOwned[SECOND] = game.ownedCount[SECOND];
+	}
+}
+
 void drawHelp(){
-	int gridEnd = (GRID_Y+1) * LINE_PER_GRID;
+	int gridEnd = (VIEW_Y+1) * LINE_PER_GRID;
 	renderText(5, gridEnd + 1, "Player 1: WASD = move cursor, Space = Select");
 	renderText(5, gridEnd + 2, "          Hold shift when moving unit to move half instead of all");
 	renderText(5, gridEnd + 3, "Player 2: Arrow keys = move cursor, Enter = Select");
 	renderText(5, gridEnd + 4, "          Hold ctrl when moving unit to move half instead of all");
 }
 
-void drawUnitCount(int gridX, int gridY){
-	int unit = animatedUnitCount[gridX][gridY];
-	
-	int currentY = (gridY + GRID_START_OFFSET_Y) * LINE_PER_GRID + 1;
-	int currentX = (gridX + GRID_START_OFFSET_X) * GRID_TEXT_SIZE - 1;
-	int counter = GRID_TEXT_SIZE - 1;
-	while(unit){
-		drawDigit(currentX + counter, currentY, unit % 10);
-		unit /= 10;
-		counter -= 1;
-	}
-	if(animatedUnitCount[gridX][gridY] > 0 && animatedUnitCount[gridX][gridY] < 10){
-		drawDigit(currentX + counter, currentY, 0);
-		//dirty fix..
-	}
-}
+/* ↓↓↓ Sprites ↓↓↓ */
+//one row of bits per glyph line, the highest used bit is the left pixel
+const unsigned char digitGlyphs5x7[10][7] = {
+	{0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E},
+	{0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}, {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E},
+	{0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}, {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E},
+	{0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}, {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+	{0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}, {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C}
+};
+const unsigned char digitGlyphs3x5[10][5] = {
+	{7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+	{7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7}
+};
+//indexed by terrain, EMPTY has no letter
+const unsigned char terrainGlyphs3x5[4][5] = {
+	{0, 0, 0, 0, 0}, {5, 7, 7, 5, 5}, {6, 5, 6, 5, 6}, {7, 2, 2, 2, 2}
+};
 
-void drawTileType(int gridX, int gridY){
-	int terrain = gridTerrain[gridX][gridY];
-	int currentY = (gridY + GRID_START_OFFSET_Y) * LINE_PER_GRID + 2;
-	int currentX = (gridX + GRID_START_OFFSET_X) * GRID_TEXT_SIZE + 2;
-	switch(terrain){
-		case EMPTY:
-			break;
-		case MOUNTAIN:
-			drawAscii(currentX, currentY, 'M');
-			break;
-		case BASE:
-			drawAscii(currentX, currentY, 'B');
-			break;
-		case TOWER:
-			drawAscii(currentX, currentY, 'T');
-			break;
+void drawGlyph(unsigned short * sprite, int spriteWidth, const unsigned char * glyph, int width, int height, int x, int y){
+	for(int row = 0; row < height; row++){
+		for(int col = 0; col < width; col++){
+			if((glyph[row] >> (width - 1 - col)) & 1){
+				sprite[(y + row) * spriteWidth + x + col] = SPRITE_TEXT_COLOR;
+			}
+		}
 	}
 }
 
-void drawTileFaction(int gridX, int gridY){
-	int faction = tileFaction[gridX][gridY];
-	int color = -1;
-	if(faction == FIRST){
-		color = FIRST_COLOR;
-	}else if(faction == SECOND){
-		color = SECOND_COLOR;
+//renders every tile look and every unit count once, so drawing a tile is only copying rows
+void buildSprites(){
+	unsigned short factionColor[3] = {BACKGROUND_COLOR, FIRST_COLOR, SECOND_COLOR};
+	unsigned short highlightColor[3] = {GRID_COLOR, FIRST_SELECT_COLOR, SECOND_SELECT_COLOR};
+	for(int terrain = EMPTY; terrain <= TOWER; terrain++){
+		for(int faction = NONE; faction <= SECOND; faction++){
+			for(int highlight = NONE; highlight <= SECOND; highlight++){
+				unsigned short * sprite = &tileSprites[terrain][faction][highlight][0][0];
+				spriteTarget = sprite;
+				spriteTargetWidth = TILE_SPRITE_WIDTH;
+				draw_rect(0, 0, TILE_SPRITE_WIDTH - 1, TILE_SPRITE_HEIGHT - 1, highlightColor[highlight]);
+				draw_rect(1, 1, TILE_SPRITE_WIDTH - 2, TILE_SPRITE_HEIGHT - 2, factionColor[faction]);
+				clear_rect(2, 2, TILE_SPRITE_WIDTH - 3, TILE_SPRITE_HEIGHT - 3);
+				drawGlyph(sprite, TILE_SPRITE_WIDTH, terrainGlyphs3x5[terrain], 3, 5, TERRAIN_GLYPH_X, TERRAIN_GLYPH_Y);
+			}
+		}
 	}
 	
-	if(color != -1){
-		int left = (GRID_START_OFFSET_X + gridX)*GRID_SIZE_X + 1;
-		int right = (GRID_START_OFFSET_X + gridX + 1)*GRID_SIZE_X - 1;
-		int top = (GRID_START_OFFSET_Y + gridY)*GRID_SIZE_Y + 1;
-		int bottom = (GRID_START_OFFSET_Y + gridY + 1)*GRID_SIZE_Y - 1;
-		
-		draw_line(left, top, left, bottom, color);
-		draw_line(right, top, right, bottom, color);
-		draw_line(left, top, right, top, color);
-		draw_line(left, bottom, right, bottom, color);
+	//right aligned without leading zeros, 0 is never drawn
+	for(int count = 0; count <= MAX_UNIT; count++){
+		unsigned short * sprite = &unitSprites[count][0][0];
+		spriteTarget = sprite;
+		spriteTargetWidth = UNIT_SPRITE_WIDTH;
+		clear_rect(0, 0, UNIT_SPRITE_WIDTH - 1, UNIT_SPRITE_HEIGHT - 1);
+		int value = count;
+		for(int d = UNIT_DIGITS - 1; d >= 0 && value > 0; d--){
+			int x = d * (UNIT_GLYPH_WIDTH + 1);
+#if UNIT_DIGITS > 2
+			drawGlyph(sprite, UNIT_SPRITE_WIDTH, digitGlyphs3x5[value % 10], 3, 5, x, 0);
+#else
+			drawGlyph(sprite, UNIT_SPRITE_WIDTH, digitGlyphs5x7[value % 10], 5, 7, x, 0);
+#endif
+			value /= 10;
+		}
 	}
+	spriteTarget = 0;
 }
 
-void drawSelection(int side){
-	int x;
-	int y;
-	if(side == FIRST){
-		x = playerOneSelectX;
-		y = playerOneSelectY;
-	}else if(side == SECOND){
-		x = playerTwoSelectX;
-		y = playerTwoSelectY;
-	}else{
-		return;	
+//a tile is its look and its shown unit count, highlight is the side whose highlight it carries or NONE
+void drawTile(int gridX, int gridY, int highlight){
+	struct Tile * tile = getTile(&game, gridX, gridY);
+	int left = (GRID_START_OFFSET_X + gridX - cameraX)*GRID_SIZE_X;
+	int top = (GRID_START_OFFSET_Y + gridY - cameraY)*GRID_SIZE_Y;
+	blit_sprite(&tileSprites[tile->terrain][tile->faction][highlight][0][0], TILE_SPRITE_WIDTH, TILE_SPRITE_HEIGHT, left, top);
+	if(tile->animatedUnitCount > 0){
+		blit_sprite(&unitSprites[tile->animatedUnitCount][0][0], UNIT_SPRITE_WIDTH, UNIT_SPRITE_HEIGHT, left + UNIT_SPRITE_X, top + UNIT_SPRITE_Y);
 	}
-	drawHighlight(x, y, side);
+}
+/* ↑↑↑ Sprites ↑↑↑ */
+
+void drawSelection(int side){
+	if(side != FIRST && side != SECOND) return;
+	addHighlight(game.cursorX[side], game.cursorY[side], side);
 }
 
 void flashHighlight(int side){
-	if(currentCalculatedTick % 4 < 2){
-		int x;
-		int y;
-		if(side == FIRST){
-			x = playerOneSelectX;
-			y = playerOneSelectY;
-		}else if(side == SECOND){
-			x = playerTwoSelectX;
-			y = playerTwoSelectY;
-		}else{
-			return;	
-		}
-		if(x > 0 && gridTerrain[x - 1][y] != MOUNTAIN){
-			drawHighlight(x - 1, y, side);
-		}
-		if(x < GRID_X - 1 && gridTerrain[x + 1][y] != MOUNTAIN){
-			drawHighlight(x + 1, y, side);
-		}
-		if(y > 0 && gridTerrain[x][y - 1] != MOUNTAIN){
-			drawHighlight(x, y - 1, side);
+	if(game.tick % 4 < 2){
+		if(side != FIRST && side != SECOND) return;
+		//the four neighbours directly, a bitboard of targets would cost the whole map on large builds
+		for(int direction = UP; direction <= RIGHT; direction++){
+			int x;
+			int y;
+			if(getMoveTarget(&game, game.cursorX[side], game.cursorY[side], direction, &x, &y) && !bbTest(&game.mountainBoard, x, y)){
+				addHighlight(x, y, side);
+			}
 		}
-		if(y < GRID_Y - 1 && gridTerrain[x][y+1] != MOUNTAIN){
-			drawHighlight(x, y + 1, side);
+	}
+}
+
+//what drawTile writes for the tile at (gridX, gridY)
+int tilePixelWrites(int gridX, int gridY){
+	if(getTile(&game, gridX, gridY)->animatedUnitCount > 0){
+		return TILE_SPRITE_PIXELS + UNIT_SPRITE_PIXELS;
+	}
+	return TILE_SPRITE_PIXELS;
+}
+
+//the pixel writes of repainting every tile in view and then every highlight on top,
+//what a frame without any damage tracking writes
+int fullRedrawPixelWrites(){
+	int writes = 0;
+	for(int j = cameraY; j < cameraY + VIEW_Y; j++){
+		for(int i = cameraX; i < cameraX + VIEW_X; i++){
+			writes += tilePixelWrites(i, j);
 		}
 	}
+	for(int i = 0; i < wantedHighlightCount; i++){
+		int tile = wantedHighlight[i] >> 2;
+		writes += tilePixelWrites(tile % GRID_X, tile / GRID_X);
+	}
+	return writes;
 }
 
 void drawHighlight(int x, int y, int side){
-	int color;
-	if(side == FIRST){
-		color = FIRST_SELECT_COLOR;
-	}else if(side == SECOND){
-		color = SECOND_SELECT_COLOR;
-	}else{
-		return;	
+	if(side != FIRST && side != SECOND) return;
+	drawTile(x, y, side);
+}
+
+//repaints the tiles damaged since the current back buffer was last shown,
+//returns the amount of tiles repainted
+int drawGrid(){
+	int buffer = getBackBufferIndex();
+	int tilesDrawn = 0;
+	
+	if(fullRedraw[buffer]){
+		fullRedraw[buffer] = false;
+		//the sprites bring their grid lines along, so this also takes care of the damage list
+		clearDamage(buffer);
+		for(int j = cameraY; j < cameraY + VIEW_Y; j++){
+			for(int i = cameraX; i < cameraX + VIEW_X; i++){
+				drawTile(i, j, NONE);
+			}
+		}
+		return VIEW_X * VIEW_Y;
 	}
 	
+	while(damageCount[buffer] > 0){
+		damageCount[buffer] -= 1;
+		int tile = damageList[buffer][damageCount[buffer]];
+		int i = tile % GRID_X;
+		int j = tile / GRID_X;
+		tileDamage[j][i] &= ~(1 << buffer);
+		if(!inView(i, j, cameraX, cameraY)) continue;	//scrolled away since it was damaged
+		
+		//the sprite also erases whatever highlight was on its border
+		drawTile(i, j, NONE);
+		tilesDrawn += 1;
+	}
+	return tilesDrawn;
+}
+
+//eases the listed counts one step for every ANIMATION_STEP_CYCLES that passed, so they move
+//at the same speed however often frames are drawn. settled tiles leave the list
+void doAnimation(){
+	int steps = (timerCycles() - animationCycles) / ANIMATION_STEP_CYCLES;
+	if(steps == 0) return;
+	animationCycles += steps * ANIMATION_STEP_CYCLES;
 	
-	int left = (GRID_START_OFFSET_X + x)*GRID_SIZE_X;
-	int right = (GRID_START_OFFSET_X + x + 1)*GRID_SIZE_X;
-	int top = (GRID_START_OFFSET_Y + y)*GRID_SIZE_Y;
-	int bottom = (GRID_START_OFFSET_Y + y + 1)*GRID_SIZE_Y;
+	for(int n = animatingCount - 1; n >= 0; n--){
+		int i = animatingTiles[n] % GRID_X;
+		int j = animatingTiles[n] / GRID_X;
+		struct Tile * tile = getTile(&game, i, j);
+		for(int step = 0; step < steps && tile->animatedUnitCount != tile->unitCount; step++){
+			if(tile->animatedUnitCount > tile->unitCount){
+				tile->animatedUnitCount -= (((tile->animatedUnitCount - tile->unitCount)/3 < 1) ? 1 : ((tile->animatedUnitCount - tile->unitCount)/3));
+			}else{
+				tile->animatedUnitCount += (((tile->unitCount - tile->animatedUnitCount)/3 < 1) ? 1 : ((tile->unitCount - tile->animatedUnitCount)/3));
+			}
+		}
+		if(tile->animatedUnitCount == tile->unitCount){
+			bbClear(&animatingBoard, i, j);
+			animatingCount -= 1;
+			animatingTiles[n] = animatingTiles[animatingCount];
+		}
+		markTileDirty(i, j);
+	}
+}
 
-	draw_line(left, top, left, bottom, color);
-	draw_line(right, top, right, bottom, color);
-	draw_line(left, top, right, top, color);
-	draw_line(left, bottom, right, bottom, color);
+//turns the tiles the game changed since the last frame into damage, and lets their counts animate
+void collectChangedTiles(){
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		unsigned long long words = game.changedWords[s];
+		game.changedWords[s] = 0;
+		while(words){
+			int w = s * 64 + __builtin_ctzll(words);
+			words &= words - 1;
+			unsigned long long bits = game.changedBoard.word[w];
+			game.changedBoard.word[w] = 0;
+			while(bits){
+				int index = w * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				int i = index % GRID_X;
+				int j = index / GRID_X;
+				markTileDirty(i, j);
+				if(getTile(&game, i, j)->animatedUnitCount != getTile(&game, i, j)->unitCount && !bbTest(&animatingBoard, i, j)){
+					bbSet(&animatingBoard, i, j);
+					animatingTiles[animatingCount] = index;
+					animatingCount += 1;
+				}
+			}
+		}
+	}
 }
 
-void drawGrid(){
-	//first draw vertical lines
-	for(int i = GRID_START_OFFSET_X; i <= GRID_START_OFFSET_X+GRID_X; i++){
-		draw_line(GRID_SIZE_X * i, GRID_START_Y, GRID_SIZE_X * i, GRID_END_Y, GRID_COLOR);
+//adds a tile in view to the damage list of a buffer if it is not in there yet, tiles out of
+//view are painted once they are scrolled in. a list that would overflow turns into a full redraw
+void damageTile(int buffer, int gridX, int gridY){
+	if(!inView(gridX, gridY, cameraX, cameraY) || fullRedraw[buffer]) return;
+	if(tileDamage[gridY][gridX] & (1 << buffer)) return;
+	if(damageCount[buffer] >= DAMAGE_LIST_SIZE){
+		clearDamage(buffer);
+		fullRedraw[buffer] = true;
+		return;
 	}
-	//then draw horizontal lines
-	for(int i = GRID_START_OFFSET_Y; i <= GRID_START_OFFSET_Y+GRID_Y; i++){
-		draw_line(GRID_START_X, GRID_SIZE_Y * i,GRID_END_X, GRID_SIZE_Y * i, GRID_COLOR);
+	tileDamage[gridY][gridX] |= (1 << buffer);
+	damageList[buffer][damageCount[buffer]] = gridY * GRID_X + gridX;
+	damageCount[buffer] += 1;
+}
+
+//empties the damage list of a buffer without drawing it
+void clearDamage(int buffer){
+	for(int i = 0; i < damageCount[buffer]; i++){
+		int tile = damageList[buffer][i];
+		tileDamage[tile / GRID_X][tile % GRID_X] &= ~(1 << buffer);
 	}
-	
-	//then for all tile draw its unit count
-	for(int i = 0; i < GRID_X; i++){
-		for(int j = 0; j < GRID_Y; j++){
-			drawUnitCount(i, j);
-			drawTileType(i, j);
-			drawTileFaction(i, j);
-		}
+	damageCount[buffer] = 0;
+}
+
+//the tile content changed, so both buffers are out of date
+void markTileDirty(int gridX, int gridY){
+	for(int buffer = 0; buffer < FRAME_BUFFER_COUNT; buffer++){
+		damageTile(buffer, gridX, gridY);
 	}
 }
 
-//used to initialize the pixel buffer
-void initializeBuffer(){
-	volatile int * pixel_ctrl_ptr = (int *)0xFF203020;
-	
-	*(pixel_ctrl_ptr + 1) = 0xC8000000;
-	wait_sync();	//then switch this to the current (so the other will will be swapped to back buffer and we can change its location
-	pixel_buffer_start = *(pixel_ctrl_ptr);
-	clear_screen();
+//used after the buffers are cleared
+void markAllTilesDirty(){
+	for(int buffer = 0; buffer < FRAME_BUFFER_COUNT; buffer++){
+		clearDamage(buffer);
+		fullRedraw[buffer] = true;
+		drawnHighlightCount[buffer] = 0;
+		bufferCameraX[buffer] = cameraX;
+		bufferCameraY[buffer] = cameraY;
+	}
+}
 
-	*(pixel_ctrl_ptr + 1) = 0xC0000000;		//then we set the back buffer to another address
-	pixel_buffer_start = *(pixel_ctrl_ptr + 1);
-	clear_screen();
+//true if (gridX, gridY) is inside the view with the top left tile (viewX, viewY)
+int inView(int gridX, int gridY, int viewX, int viewY){
+	return gridX >= viewX && gridX < viewX + VIEW_X && gridY >= viewY && gridY < viewY + VIEW_Y;
 }
 
+//puts the cursor of a side in the middle of the view, as far as the map allows
+void centerCamera(int side){
+	cameraX = game.cursorX[side] - VIEW_X / 2;
+	cameraY = game.cursorY[side] - VIEW_Y / 2;
+	followCursor(side);
+	for(int faction = FIRST; faction <= SECOND; faction++){
+		followedCursorX[faction] = game.cursorX[faction];
+		followedCursorY[faction] = game.cursorY[faction];
+	}
+}
 
-void swap(int *xp, int *yp){
-    int temp = *xp;
-    *xp = *yp;
-    *yp = temp;
+//moves the camera as little as possible to keep CAMERA_MARGIN tiles around the cursor of a side
+void followCursor(int side){
+	int x = game.cursorX[side];
+	int y = game.cursorY[side];
+	if(x < cameraX + CAMERA_MARGIN){
+		cameraX = x - CAMERA_MARGIN;
+	}else if(x >= cameraX + VIEW_X - CAMERA_MARGIN){
+		cameraX = x - VIEW_X + CAMERA_MARGIN + 1;
+	}
+	if(y < cameraY + CAMERA_MARGIN){
+		cameraY = y - CAMERA_MARGIN;
+	}else if(y >= cameraY + VIEW_Y - CAMERA_MARGIN){
+		cameraY = y - VIEW_Y + CAMERA_MARGIN + 1;
+	}
+	cameraX = MIN(cameraX, game.width - VIEW_X);
+	cameraY = MIN(cameraY, game.height - VIEW_Y);
+	cameraX = MAX(cameraX, 0);
+	cameraY = MAX(cameraY, 0);
 }
 
+//the camera follows whichever cursor moved since the last frame, the second side last
+void updateCamera(){
+	for(int side = FIRST; side <= SECOND; side++){
+		if(game.cursorX[side] != followedCursorX[side] || game.cursorY[side] != followedCursorY[side]){
+			followedCursorX[side] = game.cursorX[side];
+			followedCursorY[side] = game.cursorY[side];
+			followCursor(side);
+		}
+	}
+}
 
-void draw_line(int x0, int y0, int x1, int y1, short int color){
-	int is_steep = (ABS(y1 - y0) > ABS(x1 - x0)) ? 1 : 0;
-	
-	if(is_steep == 1){
-		swap(&x0, &y0);
-		swap(&x1, &y1);
+//moves the pixels of a buffer drawn at an older camera position and damages only the strip
+//that was scrolled in, a jump further than the view redraws the buffer instead
+void scrollBuffer(int buffer){
+	int dx = cameraX - bufferCameraX[buffer];
+	int dy = cameraY - bufferCameraY[buffer];
+	if(dx == 0 && dy == 0) return;
+	if(!fullRedraw[buffer] && (ABS(dx) >= VIEW_X || ABS(dy) >= VIEW_Y)){
+		clearDamage(buffer);
+		fullRedraw[buffer] = true;
 	}
-	
-	if (x0 > x1){
-		swap(&x0, &x1);
+	if(!fullRedraw[buffer]){
+		framePixelWrites += move_block(pixel_buffer_start, PIXEL_ROW_BYTES, (GRID_START_X) * 2, GRID_START_Y, (GRID_END_X) * 2 + 1, GRID_END_Y,
+			-dx * (GRID_SIZE_X) * 2, -dy * (GRID_SIZE_Y)) / 2;
+		for(int j = cameraY; j < cameraY + VIEW_Y; j++){
+			for(int i = cameraX; i < cameraX + VIEW_X; i++){
+				if(!inView(i, j, bufferCameraX[buffer], bufferCameraY[buffer])){
+					damageTile(buffer, i, j);
+				}
+			}
+		}
+	}
+	bufferCameraX[buffer] = cameraX;
+	bufferCameraY[buffer] = cameraY;
+}
+
+int getBackBufferIndex(){
+	return ((unsigned int)pixel_buffer_start == FPGA_ONCHIP_BASE) ? 0 : 1;
+}
+
+void addHighlight(int x, int y, int side){
+	if(wantedHighlightCount >= MAX_HIGHLIGHTS || !inView(x, y, cameraX, cameraY)) return;
+	wantedHighlight[wantedHighlightCount] = (y * GRID_X + x) * 4 + side;
+	wantedHighlightCount += 1;
+}
+
+//damages the tiles whose highlight this buffer holds but should not anymore,
+//returns true when the highlights of the buffer need to be redrawn
+int updateHighlights(int buffer){
+	int changed = (drawnHighlightCount[buffer] != wantedHighlightCount);
+	for(int i = 0; i < drawnHighlightCount[buffer]; i++){
+		int stillWanted = false;
+		for(int j = 0; j < wantedHighlightCount; j++){
+			if(wantedHighlight[j] == drawnHighlight[buffer][i]){
+				stillWanted = true;
+			}
+		}
+		if(!stillWanted){
+			int x = (drawnHighlight[buffer][i] >> 2) % GRID_X;
+			int y = (drawnHighlight[buffer][i] >> 2) / GRID_X;
+			if(inView(x, y, cameraX, cameraY)){
+				damageTile(buffer, x, y);
+			}else{
+				//scrolled out, only the borders it shares with the view can still show it
+				damageTile(buffer, x - 1, y);
+				damageTile(buffer, x + 1, y);
+				damageTile(buffer, x, y - 1);
+				damageTile(buffer, x, y + 1);
+			}
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+//used to initialize the pixel buffer
+void initializeBuffer(){
+	halWrite32(PIXEL_BUF_CTRL_BASE + 4, FPGA_ONCHIP_BASE);
+	wait_sync();	//then switch this to the current (so the other will will be swapped to back buffer and we can change its location
+	pixel_buffer_start = halRead32(PIXEL_BUF_CTRL_BASE);
+	clear_screen();
+
+	halWrite32(PIXEL_BUF_CTRL_BASE + 4, SDRAM_BASE);		//then we set the back buffer to another address
+	pixel_buffer_start = halRead32(PIXEL_BUF_CTRL_BASE + 4);
+	clear_pixel_buffer();	//the character buffer is shared and already cleared
+}
+
+
+void swap(int *xp, int *yp){
+    int temp = *xp;
+    *xp = *yp;
+    *yp = temp;
+}
+
+
+//the kernels draw into the back buffer, or into spriteTarget while buildSprites renders the atlas
+unsigned short * pixelAddress(int x, int y){
+	if(spriteTarget){
+		return spriteTarget + y * spriteTargetWidth + x;
+	}
+	return (unsigned short *)halMemory(pixel_buffer_start + (y << 10) + (x << 1));
+}
+
+int pixelRowStep(){
+	return spriteTarget ? spriteTargetWidth : PIXEL_ROW_BYTES / 2;
+}
+
+//only stores into the back buffer are device writes
+void countPixelStores(int pixels, int stores){
+	if(spriteTarget) return;
+	framePixelWrites += pixels;
+	halCountStores(stores);
+}
+
+void draw_line(int x0, int y0, int x1, int y1, short int color){
+	//axis aligned lines do not need bresenham
+	if(y0 == y1){
+		draw_hline(x0, x1, y0, color);
+		return;
+	}
+	if(x0 == x1){
+		draw_vline(x0, y0, y1, color);
+		return;
+	}
+	
+	int is_steep = (ABS(y1 - y0) > ABS(x1 - x0)) ? 1 : 0;
+	
+	if(is_steep == 1){
+		swap(&x0, &y0);
+		swap(&x1, &y1);
+	}
+	
+	if (x0 > x1){
+		swap(&x0, &x1);
 		swap(&y0, &y1);
 	}
 	
@@ -1055,42 +3081,2379 @@ void draw_line(int x0, int y0, int x1, int y1, short int color){
 	
 }
 
+//writes four pixels per store once the address is 8 byte aligned
+void draw_hline(int x0, int x1, int y, short int color){
+	if(x0 > x1){
+		swap(&x0, &x1);
+	}
+	int count = x1 - x0 + 1;
+	int stores = 0;
+	
+	unsigned short * pixel = pixelAddress(x0, y);
+	while(count > 0 && ((unsigned long)pixel & 7) != 0){
+		*pixel = color;
+		pixel += 1;
+		count -= 1;
+		stores += 1;
+	}
+	
+	unsigned int pair = (unsigned short)color | ((unsigned int)(unsigned short)color << 16);
+	unsigned long long quad = pair | ((unsigned long long)pair << 32);
+	unsigned long long * wide = (unsigned long long *)pixel;
+	while(count >= 4){
+		*wide = quad;
+		wide += 1;
+		count -= 4;
+		stores += 1;
+	}
+	
+	pixel = (unsigned short *)wide;
+	while(count > 0){
+		*pixel = color;
+		pixel += 1;
+		count -= 1;
+		stores += 1;
+	}
+	countPixelStores(x1 - x0 + 1, stores);
+}
+
+void draw_vline(int x, int y0, int y1, short int color){
+	if(y0 > y1){
+		swap(&y0, &y1);
+	}
+	unsigned short * pixel = pixelAddress(x, y0);
+	int step = pixelRowStep();
+	for(int y = y0; y <= y1; y++){
+		*pixel = color;
+		pixel += step;
+	}
+	countPixelStores(y1 - y0 + 1, y1 - y0 + 1);
+}
+
+//outline only, each corner is written once
+void draw_rect(int left, int top, int right, int bottom, short int color){
+	draw_line(left, top, right, top, color);
+	draw_line(left, bottom, right, bottom, color);
+	if(bottom - top > 1){
+		draw_line(left, top + 1, left, bottom - 1, color);
+		draw_line(right, top + 1, right, bottom - 1, color);
+	}
+}
+
+void fill_rect(int left, int top, int right, int bottom, short int color){
+	for(int y = top; y <= bottom; y++){
+		draw_hline(left, right, y, color);
+	}
+}
+
 void wait_sync(){
-	volatile int * pixel_ctrl_ptr = (int *)0xFF203020;
-	*pixel_ctrl_ptr = 1;		//enable sync
-	volatile char * status_ptr = (char *)0xFF20302C;
+	PROFILE_START(PROFILE_SYNC);
+	halWrite32(PIXEL_BUF_CTRL_BASE, 1);		//enable sync
 	while(1){
-		if(((*status_ptr) & 1) == 0) break;	//wait for status to be 0
+		if((halRead8(PIXEL_BUF_CTRL_BASE + 12) & 1) == 0) break;	//wait for status to be 0
 	}
+	PROFILE_END(PROFILE_SYNC);
+	swapPending = false;
+}
+
+//checks once whether the requested swap happened, the status goes back to 0 at the vertical sync
+int swapFinished(){
+	if(swapPending && (halRead8(PIXEL_BUF_CTRL_BASE + 12) & 1) == 0){
+		swapPending = false;
+		pixel_buffer_start = halRead32(PIXEL_BUF_CTRL_BASE + 4);
+		frameStartCycles = halCycles();
+		PROFILE_END(PROFILE_SYNC);
+		PROFILE_FRAME();
+	}
+	return swapPending == false;
 }
 
 void clear_screen(){
-	volatile short int * pixel_ctrl_ptr = (short int *)0xFF203020;
-	short x = *(pixel_ctrl_ptr+4);
-	short y = *(pixel_ctrl_ptr+5);
-	for(int currentX = 0; currentX < x; currentX++){
-		for(int currentY = 0; currentY < y; currentY++){
-			plot_pixel(currentX, currentY, BACKGROUND_COLOR);
-		}
+	clear_pixel_buffer();
+	clear_char_buffer();
+}
+
+void clear_pixel_buffer(){
+	short x = halRead16(PIXEL_BUF_CTRL_BASE + 8);
+	short y = halRead16(PIXEL_BUF_CTRL_BASE + 10);
+	fill_rect(0, 0, x - 1, y - 1, BACKGROUND_COLOR);
+}
+
+//what the character buffer holds is unknown, so the next flush writes all of it
+void clear_char_buffer(){
+	fill_text_rect(0, 0, CHAR_BUF_WIDTH - 1, CHAR_BUF_HEIGHT - 1, ' ');
+	memset(textShown, 0, sizeof(textShown));
+	hudTick = -1;
+}
+
+void clear_rect(int left, int top, int right, int bottom){
+	fill_rect(left, top, right, bottom, BACKGROUND_COLOR);
+}
+
+void fill_text_rect(int left, int top, int right, int bottom, char val){
+	for(int y = top; y <= bottom; y++){
+		memset(&textShadow[y][left], val, right - left + 1);
+		textDirtyRows |= 1ULL << y;
+		textCharsWritten += right - left + 1;
 	}
-	for(int currentX = 0; currentX < 80; currentX++){
-		for(int currentY = 0; currentY < 60; currentY++){
-			drawAscii(currentX, currentY, ' ');
+}
+
+//sends the written rows to the character buffer, four characters per store and only
+//the words that changed, so text that stays the same costs no device writes
+void flushText(){
+	while(textDirtyRows){
+		int y = __builtin_ctzll(textDirtyRows);
+		textDirtyRows &= textDirtyRows - 1;
+		for(int x = 0; x < CHAR_BUF_WIDTH; x += 4){
+			unsigned int wanted;
+			unsigned int shown;
+			memcpy(&wanted, &textShadow[y][x], 4);
+			memcpy(&shown, &textShown[y][x], 4);
+			if(wanted != shown){
+				memcpy(&textShown[y][x], &wanted, 4);
+				halWrite32(FPGA_CHAR_BASE + y * CHAR_ROW_BYTES + x, wanted);
+				frameCharWrites += 4;
+			}
 		}
 	}
 }
 
+//moves the content of a rectangle of a buffer by (dx, dy), in bytes and rows, what would leave the
+//rectangle is dropped and what is left behind keeps its old content. returns the bytes moved
+int move_block(unsigned int base, int rowBytes, int left, int top, int right, int bottom, int dx, int dy){
+	int width = right - left + 1 - ABS(dx);
+	int height = bottom - top + 1 - ABS(dy);
+	if(width <= 0 || height <= 0) return 0;
+	int fromX = left + MAX(-dx, 0);
+	int toX = left + MAX(dx, 0);
+	//rows are copied away from the direction they move in, so none is overwritten before it is read
+	for(int n = 0; n < height; n++){
+		int row = (dy > 0) ? height - 1 - n : n;
+		int fromY = top + MAX(-dy, 0) + row;
+		int toY = top + MAX(dy, 0) + row;
+		memmove(halMemory(base + toY * rowBytes + toX), halMemory(base + fromY * rowBytes + fromX), width);
+		halCountStores((width + 7) / 8);
+	}
+	return width * height;
+}
+
+//copies a sprite into the back buffer row by row
+void blit_sprite(unsigned short * sprite, int width, int height, int x, int y){
+	framePixelWrites += width * height;
+	for(int row = 0; row < height; row++){
+		memcpy(halMemory(pixel_buffer_start + ((y + row) << 10) + (x << 1)), sprite + row * width, width * 2);
+		halCountStores((width * 2 + 7) / 8);
+	}
+}
+
 void plot_pixel(int x, int y, short int line_color)
 {	
-    *(short int *)(pixel_buffer_start + (y << 10) + (x << 1)) = line_color;
+    *pixelAddress(x, y) = line_color;
+    countPixelStores(1, 1);
 }
 
-void drawDigit(int x, int y, int val){
-	drawAscii(x, y, '0'+val);
+//the characters of 00 to 99, so numbers are written two digits at a time
+const char digitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+//right aligns value in width characters, leading zeros are left blank
+void renderNumber(int x, int y, int value, int width){
+	char * text = &textShadow[y][x];
+	int n = width;
+	while(n > 0){
+		const char * pair = &digitPairs[(value % 100) * 2];
+		value /= 100;
+		text[n - 1] = pair[1];
+		n -= 1;
+		if(n == 0 || (value == 0 && pair[0] == '0')) break;
+		text[n - 1] = pair[0];
+		n -= 1;
+		if(value == 0) break;
+	}
+	while(n > 0){
+		text[n - 1] = ' ';
+		n -= 1;
+	}
+	textDirtyRows |= 1ULL << y;
+	textCharsWritten += width;
 }
 
 void drawAscii(int x, int y, char val){
-	volatile char * character_buffer = (char *) (0xC9000000 + (y<<7) + x);
-	*character_buffer = val;
+	textShadow[y][x] = val;
+	textDirtyRows |= 1ULL << y;
+	textCharsWritten += 1;
 }
 /* ↑↑↑ Rendering ↑↑↑ */
+#endif
+
+#ifdef HOST_BUILD
+/* ↓↓↓ Host Benchmark ↓↓↓ */
+//gcc -O2 -DHOST_BUILD genral.io.c -o generalio -lm -pthread
+//add -DGENERAL_LIBRARY -c to get just the game core as an object file
+
+double getSeconds(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+//every measurement runs in batches until BENCHMARK_SECONDS passed, so large maps do not take ages
+#define BENCHMARK_SECONDS 0.25
+#define BENCHMARK_BATCH 4096
+
+void benchmarkMapSize(int width, int height){
+	static struct GameState state;	//too big for the stack of large builds
+	
+	gameInit(&state, width, height, 1);
+	int ticks = 0;
+	double start = getSeconds();
+	double tickSeconds;
+	do{
+		for(int i = 0; i < BENCHMARK_BATCH; i++){
+			gameStep(&state, 1);
+		}
+		ticks += BENCHMARK_BATCH;
+		tickSeconds = getSeconds() - start;
+	}while(tickSeconds < BENCHMARK_SECONDS);
+	
+	//one tick for every two move attempts so the bases keep producing
+	int attempts = 0;
+	int moves = 0;
+	int games = 1;
+	gameInit(&state, width, height, 2);
+	start = getSeconds();
+	double moveSeconds;
+	do{
+		for(int i = 0; i < BENCHMARK_BATCH; i++){
+			moves += playRandomMove(&state, (i & 1) ? SECOND : FIRST);
+			if(i & 1){
+				gameStep(&state, 1);
+			}
+			if(gameGetWinner(&state) != NONE){
+				gameInit(&state, width, height, nextRandom(&state));
+				games += 1;
+			}
+		}
+		attempts += BENCHMARK_BATCH;
+		moveSeconds = getSeconds() - start;
+	}while(moveSeconds < BENCHMARK_SECONDS);
+	
+	printf("%4d x %-4d %14.0f %10.1f %14.0f %10.1f %10d\n", width, height, ticks / tickSeconds, tickSeconds * 1e9 / ticks,
+		moves / moveSeconds, moveSeconds * 1e9 / (attempts / 2), games);
+}
+
+//the cost of a tick should follow the producers and the changed tiles, not the area of the map
+void benchmarkGame(){
+	printf("map size    ticks/second    ns/tick   moves/second  ns/round      games\n");
+	int sizes[][2] = {{4, 3}, {8, 6}, {12, 9}, {16, 12}, {32, 24}, {64, 48}, {128, 96}, {256, 192}, {256, 256}, {512, 512}, {GRID_X, GRID_Y}};
+	int count = sizeof(sizes) / sizeof(sizes[0]);
+	for(int i = 0; i < count; i++){
+		if(sizes[i][0] > GRID_X || sizes[i][1] > GRID_Y) continue;
+		if(i < count - 1 && sizes[i][0] == GRID_X && sizes[i][1] == GRID_Y) continue;	//measured last
+		benchmarkMapSize(sizes[i][0], sizes[i][1]);
+	}
+}
+
+//saving and restoring a tick, and a rollback over the whole ring: restoring its oldest frame and
+//simulating and saving every tick after it again
+void benchmarkSnapshotSize(int width, int height){
+	static struct GameState state;
+	static struct SnapshotRing ring;
+	
+	gameInit(&state, width, height, 1);
+	snapshotReset(&ring);
+	int saves = 0;
+	double start = getSeconds();
+	double saveSeconds;
+	do{
+		for(int i = 0; i < BENCHMARK_BATCH; i++){
+			snapshotSave(&ring, &state);
+		}
+		saves += BENCHMARK_BATCH;
+		saveSeconds = getSeconds() - start;
+	}while(saveSeconds < BENCHMARK_SECONDS);
+	
+	int restores = 0;
+	start = getSeconds();
+	double restoreSeconds;
+	do{
+		for(int i = 0; i < BENCHMARK_BATCH; i++){
+			snapshotRestore(&ring, &state, state.tick);
+		}
+		restores += BENCHMARK_BATCH;
+		restoreSeconds = getSeconds() - start;
+	}while(restoreSeconds < BENCHMARK_SECONDS);
+	
+	snapshotReset(&ring);
+	for(int i = 0; i < SNAPSHOT_FRAMES; i++){
+		snapshotSave(&ring, &state);
+		gameStep(&state, 1);
+	}
+	int from = snapshotOldestTick(&ring);
+	int rollbacks = 0;
+	start = getSeconds();
+	double rollbackSeconds;
+	do{
+		for(int i = 0; i < BENCHMARK_BATCH / SNAPSHOT_FRAMES; i++){
+			snapshotRestore(&ring, &state, from);
+			gameStep(&state, 1);
+			for(int t = 1; t < SNAPSHOT_FRAMES; t++){
+				snapshotSave(&ring, &state);
+				gameStep(&state, 1);
+			}
+		}
+		rollbacks += BENCHMARK_BATCH / SNAPSHOT_FRAMES;
+		rollbackSeconds = getSeconds() - start;
+	}while(rollbackSeconds < BENCHMARK_SECONDS);
+	
+	printf("%4d x %-4d %10d %10.1f %12.1f %14.1f\n", width, height, snapshotBytes(&state), saveSeconds * 1e9 / saves,
+		restoreSeconds * 1e9 / restores, rollbackSeconds * 1e9 / rollbacks);
+}
+
+void benchmarkSnapshots(){
+	printf("%d frame ring, a GameState is %d bytes\n", SNAPSHOT_FRAMES, (int)sizeof(struct GameState));
+	printf("map size        bytes    ns/save   ns/restore    ns/rollback\n");
+	int sizes[][2] = {{16, 12}, {64, 48}, {256, 192}, {512, 512}, {GRID_X, GRID_Y}};
+	int count = sizeof(sizes) / sizeof(sizes[0]);
+	for(int i = 0; i < count; i++){
+		if(sizes[i][0] > GRID_X || sizes[i][1] > GRID_Y) continue;
+		if(i < count - 1 && sizes[i][0] == GRID_X && sizes[i][1] == GRID_Y) continue;	//measured last
+		benchmarkSnapshotSize(sizes[i][0], sizes[i][1]);
+	}
+}
+
+//generates maps from consecutive seeds, optionally writing each one as a line of
+//seed,width,height and one of .MBT per tile, row by row
+void benchmarkMapGeneration(int maps, int width, int height, char * outPath){
+	FILE * file = 0;
+	if(outPath){
+		file = fopen(outPath, "w");
+		if(!file){
+			perror(outPath);
+			return;
+		}
+	}
+	struct GameState state;
+	int repaired = 0;
+	long long removed = 0;
+	double start = getSeconds();
+	for(int i = 0; i < maps; i++){
+		gameInit(&state, width, height, i + 1);
+		repaired += (state.mapRepairs > 0);
+		removed += state.mapRepairs;
+		if(file){
+			fprintf(file, "%d,%d,%d,", i + 1, width, height);
+			for(int j = 0; j < height; j++){
+				for(int k = 0; k < width; k++){
+					fputc(".MBT"[getTile(&state, k, j)->terrain], file);
+				}
+			}
+			fputc('\n', file);
+		}
+	}
+	double seconds = getSeconds() - start;
+	if(file) fclose(file);
+	printf("%d maps of %dx%d in %.3f s, %.0f maps/second, %d needed a path carved (%lld mountains removed)\n",
+		maps, width, height, seconds, maps / seconds, repaired, removed);
+}
+
+//playout speed of one search, then matches of the search as SECOND against the greedy baseline
+void benchmarkAi(int games, double seconds){
+	struct GameState state;
+	struct AiMove move;
+	gameInit(&state, GRID_X, GRID_Y, 1);
+	gameStep(&state, 40);
+	double start = getSeconds();
+	int playouts = aiChooseMove(&state, SECOND, 0, 1.0, &move);
+	printf("%d threads: %.0f playouts/second\n", aiThreadCount, playouts / (getSeconds() - start));
+	
+	int results[3] = {0, 0, 0};	//indexed by winner, NONE counts matches that ran out of rounds
+	int ahead = 0;
+	int totalRounds = 0;
+	float totalScore = 0;		//final evaluation for the search, 1 is a won match
+	for(int g = 0; g < games; g++){
+		gameInit(&state, GRID_X, GRID_Y, g + 1);
+		int round = 0;
+		while(round < AI_MATCH_ROUNDS && gameGetWinner(&state) == NONE){
+			aiChooseMove(&state, SECOND, 0, seconds, &move);
+			aiPlayMove(&state, SECOND, &move);
+			aiGreedyMove(&state, FIRST, &move);
+			aiPlayMove(&state, FIRST, &move);
+			gameStep(&state, AI_TICKS_PER_ROUND);
+			round += 1;
+		}
+		results[gameGetWinner(&state)] += 1;
+		if(gameGetWinner(&state) == NONE && aiEvaluate(&state, SECOND) > 0.5f){
+			ahead += 1;
+		}
+		totalRounds += round;
+		totalScore += aiEvaluate(&state, SECOND);
+	}
+	printf("search vs greedy, %.3f s per move: %d won, %d lost, %d unfinished (%d of them ahead), %.0f rounds per match, mean score %.3f\n",
+		seconds, results[SECOND], results[FIRST], results[NONE], ahead, (double)totalRounds / games, totalScore / games);
+}
+
+/* ↑↑↑ Host Benchmark ↑↑↑ */
+
+
+#ifndef GENERAL_LIBRARY
+/* ↓↓↓ Tournament ↓↓↓ */
+//plays many independent bot matches on a thread pool, every match has its own seed so the
+//results do not depend on the thread count or order. each worker owns a range of match numbers
+//and steals the upper half of the biggest other range once its own runs out
+//./generalio tournament [-games n] [-threads n] [-seed n] [-size WxH] [-rounds n] [-blue bot] [-red bot] [-csv file] [-records file]
+
+#define BOT_RANDOM 0
+#define BOT_GREEDY 1
+#define BOT_SEARCH 2
+
+//one finished match, the records file holds these in match order
+struct TournamentRecord{
+	unsigned int seed;
+	unsigned short rounds;
+	unsigned char winner;		//NONE for a draw
+	unsigned char decided;		//false when the winner was only ahead once the rounds ran out
+	unsigned char firstMover;	//the side that moves first every round
+	unsigned char padding[3];
+};
+
+struct TournamentWorker{
+	pthread_mutex_t lock;		//guards next and end, which other workers steal from
+	int next;
+	int end;
+	pthread_t thread;
+	struct AiSearch * search;	//only for the search bot
+};
+
+char * botNames[] = {"random", "greedy", "search"};
+
+struct TournamentWorker tournamentWorker[AI_MAX_THREADS];
+int tournamentWorkerCount;
+struct TournamentRecord * tournamentRecord;
+int tournamentWidth = GRID_X;
+int tournamentHeight = GRID_Y;
+int tournamentRounds = AI_MATCH_ROUNDS;
+int tournamentBot[3] = {BOT_GREEDY, BOT_GREEDY, BOT_GREEDY};	//indexed by faction
+unsigned int tournamentSeed = 1;
+
+//splitmix32, spreads neighbouring match numbers over unrelated seeds
+unsigned int getMatchSeed(unsigned int base, int match){
+	unsigned int x = base + match * 0x9E3779B9u;
+	x = (x ^ (x >> 16)) * 0x85EBCA6Bu;
+	x = (x ^ (x >> 13)) * 0xC2B2AE35u;
+	x ^= x >> 16;
+	return x ? x : 1;
+}
+
+void playBotMove(struct TournamentWorker * worker, struct GameState * state, int side){
+	struct AiMove move;
+	switch(tournamentBot[side]){
+		case BOT_RANDOM:
+			playRandomMove(state, side);
+			break;
+		case BOT_GREEDY:
+			aiGreedyMove(state, side, &move);
+			aiPlayMove(state, side, &move);
+			break;
+		case BOT_SEARCH:
+			aiSearchMove(worker->search, 1, state, side, AI_BOT_PLAYOUTS, 0, &move);
+			aiPlayMove(state, side, &move);
+			break;
+	}
+}
+
+void playTournamentMatch(struct TournamentWorker * worker, int match){
+	struct TournamentRecord * record = &tournamentRecord[match];
+	struct GameState state;
+	record->seed = getMatchSeed(tournamentSeed, match);
+	record->firstMover = (match & 1) ? SECOND : FIRST;	//alternated to measure the first player advantage
+	gameInit(&state, tournamentWidth, tournamentHeight, record->seed);
+	
+	int round = 0;
+	while(round < tournamentRounds && gameGetWinner(&state) == NONE){
+		playBotMove(worker, &state, record->firstMover);
+		playBotMove(worker, &state, getOpponent(record->firstMover));
+		gameStep(&state, AI_TICKS_PER_ROUND);
+		round += 1;
+	}
+	
+	record->rounds = round;
+	record->decided = (gameGetWinner(&state) != NONE);
+	record->winner = gameGetWinner(&state);
+	if(!record->decided){
+		float score = aiEvaluate(&state, FIRST);
+		if(score > 0.5f){
+			record->winner = FIRST;
+		}else if(score < 0.5f){
+			record->winner = SECOND;
+		}
+	}
+}
+
+//the next match of the worker, stolen from another worker once its own range is done, -1 when all are taken
+int takeTournamentMatch(struct TournamentWorker * worker){
+	int match = -1;
+	pthread_mutex_lock(&worker->lock);
+	if(worker->next < worker->end){
+		match = worker->next;
+		worker->next += 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	if(match != -1) return match;
+	
+	while(true){
+		struct TournamentWorker * victim = 0;
+		int most = 0;
+		for(int i = 0; i < tournamentWorkerCount; i++){
+			struct TournamentWorker * other = &tournamentWorker[i];
+			pthread_mutex_lock(&other->lock);
+			int left = other->end - other->next;	//may change once unlocked, so the steal checks it again
+			pthread_mutex_unlock(&other->lock);
+			if(left > most){
+				most = left;
+				victim = other;
+			}
+		}
+		if(victim == 0) return -1;
+		
+		int start = 0;
+		int end = 0;
+		pthread_mutex_lock(&victim->lock);
+		if(victim->next < victim->end){
+			start = victim->next + (victim->end - victim->next) / 2;
+			end = victim->end;
+			victim->end = start;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if(start == end) continue;
+		
+		pthread_mutex_lock(&worker->lock);
+		worker->next = start + 1;
+		worker->end = end;
+		pthread_mutex_unlock(&worker->lock);
+		return start;
+	}
+}
+
+void * tournamentThread(void * argument){
+	struct TournamentWorker * worker = argument;
+	int match = takeTournamentMatch(worker);
+	while(match != -1){
+		playTournamentMatch(worker, match);
+		match = takeTournamentMatch(worker);
+	}
+	return 0;
+}
+
+int getBotType(char * name){
+	for(int i = 0; i < 3; i++){
+		if(strcmp(name, botNames[i]) == 0) return i;
+	}
+	fprintf(stderr, "unknown bot %s, use random, greedy or search\n", name);
+	exit(1);
+}
+
+int runTournament(int argc, char ** argv){
+	int games = 1000;
+	int threads = aiThreadCount;
+	char * csvPath = 0;
+	char * recordsPath = 0;
+	for(int i = 0; i < argc; i++){
+		if(i + 1 >= argc){
+			fprintf(stderr, "%s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(strcmp(argv[i], "-games") == 0){
+			games = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-threads") == 0){
+			threads = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-seed") == 0){
+			tournamentSeed = strtoul(argv[++i], 0, 0);
+		}else if(strcmp(argv[i], "-size") == 0){
+			sscanf(argv[++i], "%dx%d", &tournamentWidth, &tournamentHeight);
+		}else if(strcmp(argv[i], "-rounds") == 0){
+			tournamentRounds = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-blue") == 0){
+			tournamentBot[FIRST] = getBotType(argv[++i]);
+		}else if(strcmp(argv[i], "-red") == 0){
+			tournamentBot[SECOND] = getBotType(argv[++i]);
+		}else if(strcmp(argv[i], "-csv") == 0){
+			csvPath = argv[++i];
+		}else if(strcmp(argv[i], "-records") == 0){
+			recordsPath = argv[++i];
+		}else{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(games < 1) games = 1;
+	if(threads < 1) threads = 1;
+	if(threads > AI_MAX_THREADS) threads = AI_MAX_THREADS;
+	if(tournamentWidth < 2 || tournamentWidth > GRID_X || tournamentHeight < 2 || tournamentHeight > GRID_Y){
+		fprintf(stderr, "map size must be between 2x2 and %dx%d\n", GRID_X, GRID_Y);
+		return 1;
+	}
+	if(tournamentRounds > 0xFFFF) tournamentRounds = 0xFFFF;
+	
+	tournamentRecord = calloc(games, sizeof(struct TournamentRecord));
+	tournamentWorkerCount = threads;
+	for(int t = 0; t < threads; t++){
+		struct TournamentWorker * worker = &tournamentWorker[t];
+		pthread_mutex_init(&worker->lock, 0);
+		worker->next = (long long)games * t / threads;
+		worker->end = (long long)games * (t + 1) / threads;
+		worker->search = 0;
+		if(tournamentBot[FIRST] == BOT_SEARCH || tournamentBot[SECOND] == BOT_SEARCH){
+			worker->search = malloc(sizeof(struct AiSearch));
+		}
+	}
+	
+	double start = getSeconds();
+	for(int t = 1; t < threads; t++){
+		pthread_create(&tournamentWorker[t].thread, 0, tournamentThread, &tournamentWorker[t]);
+	}
+	tournamentThread(&tournamentWorker[0]);
+	for(int t = 1; t < threads; t++){
+		pthread_join(tournamentWorker[t].thread, 0);
+	}
+	double seconds = getSeconds() - start;
+	
+	int wins[3] = {0, 0, 0};	//indexed by winner, NONE for draws
+	int decided = 0;
+	int firstMoverWins = 0;
+	long long totalRounds = 0;
+	int longest = 0;
+	for(int i = 0; i < games; i++){
+		struct TournamentRecord * record = &tournamentRecord[i];
+		wins[record->winner] += 1;
+		decided += record->decided;
+		if(record->winner == record->firstMover){
+			firstMoverWins += 1;
+		}
+		totalRounds += record->rounds;
+		if(record->rounds > longest){
+			longest = record->rounds;
+		}
+	}
+	int won = games - wins[NONE];
+	
+	printf("%d matches, %s (blue) vs %s (red), %dx%d, %d threads: %.0f matches/second\n", games,
+		botNames[tournamentBot[FIRST]], botNames[tournamentBot[SECOND]], tournamentWidth, tournamentHeight, threads, games / seconds);
+	printf("blue %.1f%%, red %.1f%%, draw %.1f%%, %.1f%% decided by a base capture\n",
+		100.0 * wins[FIRST] / games, 100.0 * wins[SECOND] / games, 100.0 * wins[NONE] / games, 100.0 * decided / games);
+	printf("first mover won %.1f%% of the matches with a winner, %.1f rounds per match, longest %d\n",
+		won ? 100.0 * firstMoverWins / won : 0.0, (double)totalRounds / games, longest);
+	
+	//one summary row per run, the header only goes into a new file
+	if(csvPath){
+		FILE * file = fopen(csvPath, "a");
+		if(!file){
+			perror(csvPath);
+			return 1;
+		}
+		if(ftell(file) == 0){
+			fprintf(file, "seed,games,width,height,rounds,productionInterval,emptyChance,mountainChance,blue,red,"
+				"blueWins,redWins,draws,decided,firstMoverWins,meanRounds,longest,threads,seconds\n");
+		}
+		fprintf(file, "%u,%d,%d,%d,%d,%d,%d,%d,%s,%s,%d,%d,%d,%d,%d,%.2f,%d,%d,%.3f\n", tournamentSeed, games,
+			tournamentWidth, tournamentHeight, tournamentRounds, PRODUCTION_INTERVAL, EMPTY_CHANCE, MOUNTAIN_CHANCE,
+			botNames[tournamentBot[FIRST]], botNames[tournamentBot[SECOND]], wins[FIRST], wins[SECOND], wins[NONE],
+			decided, firstMoverWins, (double)totalRounds / games, longest, threads, seconds);
+		fclose(file);
+	}
+	if(recordsPath){
+		FILE * file = fopen(recordsPath, "wb");
+		if(!file){
+			perror(recordsPath);
+			return 1;
+		}
+		fwrite(tournamentRecord, sizeof(struct TournamentRecord), games, file);
+		fclose(file);
+	}
+	
+	for(int t = 0; t < threads; t++){
+		free(tournamentWorker[t].search);
+	}
+	free(tournamentRecord);
+	return 0;
+}
+
+/* ↑↑↑ Tournament ↑↑↑ */
+#endif
+
+
+#ifndef GENERAL_LIBRARY
+/* ↓↓↓ Match Server ↓↓↓ */
+//hosts two player matches over tcp. the main thread accepts connections and hands every pair to a
+//worker as a room. a worker runs all its rooms on one epoll loop and one fixed tick clock, and after
+//each tick sends both players of a room only the tiles that tick changed
+//./generalio server [-port n] [-threads n] [-tick-ms n] [-seconds n] [-size WxH] [-seed n]
+//./generalio loadgen [-host ip] [-port n] [-rooms n] [-threads n] [-seconds n] [-inputs n] [-late ticks]
+//
+//messages are a little endian u32 length of the rest, a type byte and the payload, numbers are varints
+//  welcome  side byte, width, height, seed as u32, tick ms. the client builds the map with gameInit
+//  delta    room tick, tile count, then per changed tile the index gap (index - last index - 1), the faction
+//           byte and the units. a flags byte follows, with bit 0 set both cursors come as x, y, selecting
+//  end      winner byte, the room is closed after it
+//clients send 7 byte inputs: INPUT_DIRECTION or INPUT_SELECT, the direction, whether to move half and the
+//tick of the last delta they had as u32. an input for a tick the room already ran rolls the room back to the
+//snapshot of that tick, applies it there and simulates forward again
+
+#define SERVER_PORT 7070
+#define SERVER_MAX_THREADS 64
+#define SERVER_EVENTS 256				//epoll events taken per wait
+#define SERVER_OUT_BYTES 65536			//unsent bytes a client may fall behind by before it is dropped
+#define SERVER_ROOM_INPUTS 32			//inputs a room keeps for its next tick
+#define SERVER_LATENCY_SAMPLES (1 << 18)	//per worker, older samples are overwritten
+#define MESSAGE_WELCOME 1
+#define MESSAGE_DELTA 2
+#define MESSAGE_END 3
+#define MESSAGE_HEADER 5
+#define INPUT_MESSAGE_BYTES 7
+/* a delta of every tile, at most 9 bytes per tile plus the tick, the count and the cursors */
+#define DELTA_MAX_BYTES (MESSAGE_HEADER + 10 + GRID_X * GRID_Y * 9 + 1 + 2 * 11)
+
+struct Room;
+
+struct Connection{
+	int fd;
+	int side;
+	struct Room * room;
+	unsigned char in[INPUT_MESSAGE_BYTES];	//a partly received input
+	int inLength;
+	unsigned char * out;		//what the socket did not take yet, only allocated while there is some
+	int outStart;
+	int outLength;
+};
+
+struct Room{
+	struct GameState state;
+	struct Connection player[3];	//indexed by faction
+	struct InputEvent inputs[SERVER_ROOM_INPUTS];	//received since the last tick
+	int inputCount;
+	int ticks;					//the game stops counting once it has a winner, deltas use this
+	struct SnapshotRing history;	//the state at the start of each recent tick
+	struct InputEvent applied[SNAPSHOT_FRAMES][SERVER_ROOM_INPUTS];	//inputs of those ticks, indexed by tick % SNAPSHOT_FRAMES
+	int appliedCount[SNAPSHOT_FRAMES];
+	unsigned long long tickWords[SNAPSHOT_FRAMES][BB_SUMMARY_WORDS];	//changedWords of those ticks, the words a rollback has to compare
+	int shownCursor[3][3];		//x, y and selecting of each side as the clients last got them
+	int closed;					//freed by the worker once it is done with its events
+	struct Room * next;
+};
+
+//what the accept thread hands a worker
+struct RoomRequest{
+	int fd[2];
+	unsigned int seed;
+};
+
+struct ServerWorker{
+	pthread_t thread;
+	int epoll;
+	int pipe[2];
+	struct Room * rooms;
+	unsigned char * message;	//scratch for building messages
+	struct GameState * rewound;	//the state before a rollback, to find the tiles it changed
+	float * latency;			//ms from a tick's deadline until a room's delta was handed to its sockets
+	long long latencyCount;
+	long long ticks;
+	long long lateTicks;		//started a whole period after their deadline
+	long long rollbacks;
+	long long replayedTicks;	//ticks simulated again by rollbacks
+	long long staleInputs;		//older than the snapshot ring, applied at the current tick instead
+	long long droppedInputs;	//came in or were filed when SERVER_ROOM_INPUTS were already there
+	long long messages;
+	long long bytes;
+	int dropped;				//clients too slow to keep up
+	int finished;				//rooms that ended with a winner
+};
+
+struct ServerWorker serverWorker[SERVER_MAX_THREADS];
+int serverTickMs = TICK_CYCLES / (CPU_HZ / 1000);	//the same clock the board ticks at
+int serverWidth = GRID_X;
+int serverHeight = GRID_Y;
+unsigned int serverSeed = 1;
+volatile int serverRunning;
+
+unsigned char * putVarint(unsigned char * p, unsigned int value){
+	while(value >= 0x80){
+		*p++ = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+//0 when the varint does not end before end
+unsigned char * getVarint(unsigned char * p, unsigned char * end, unsigned int * value){
+	*value = 0;
+	for(int shift = 0; p < end && shift < 32; shift += 7){
+		*value |= (unsigned int)(*p & 0x7F) << shift;
+		if((*p++ & 0x80) == 0) return p;
+	}
+	return 0;
+}
+
+unsigned char * beginMessage(unsigned char * buffer, int type){
+	buffer[4] = type;
+	return buffer + MESSAGE_HEADER;
+}
+
+//fills in the length, returns the bytes of the whole message
+int endMessage(unsigned char * buffer, unsigned char * end){
+	unsigned int length = end - buffer - 4;
+	for(int i = 0; i < 4; i++){
+		buffer[i] = length >> (i * 8);
+	}
+	return end - buffer;
+}
+
+void prepareSocket(int fd){
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+//thousands of rooms need more sockets than the default limit allows
+void raiseFileLimit(){
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0){
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+void watchConnection(struct ServerWorker * worker, struct Connection * connection, int operation, int events){
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = connection;
+	epoll_ctl(worker->epoll, operation, connection->fd, &event);
+}
+
+//sends what the socket takes and keeps the rest, false when the client fell too far behind
+int serverSend(struct ServerWorker * worker, struct Connection * connection, unsigned char * data, int length){
+	worker->messages += 1;
+	worker->bytes += length;
+	if(connection->outLength == 0){
+		int sent = send(connection->fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK) return false;
+			sent = 0;
+		}
+		if(sent == length) return true;
+		data += sent;
+		length -= sent;
+		watchConnection(worker, connection, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+	}
+	if(connection->outLength > SERVER_OUT_BYTES){
+		worker->dropped += 1;
+		return false;
+	}
+	if(connection->out == 0){
+		connection->out = malloc(SERVER_OUT_BYTES + DELTA_MAX_BYTES);
+		connection->outStart = 0;
+	}
+	if(connection->outStart + connection->outLength + length > SERVER_OUT_BYTES + DELTA_MAX_BYTES){
+		memmove(connection->out, connection->out + connection->outStart, connection->outLength);
+		connection->outStart = 0;
+	}
+	memcpy(connection->out + connection->outStart + connection->outLength, data, length);
+	connection->outLength += length;
+	return true;
+}
+
+//sends what was kept back once the socket has room again
+int serverFlush(struct ServerWorker * worker, struct Connection * connection){
+	while(connection->outLength > 0){
+		int sent = send(connection->fd, connection->out + connection->outStart, connection->outLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+		connection->outStart += sent;
+		connection->outLength -= sent;
+	}
+	free(connection->out);
+	connection->out = 0;
+	watchConnection(worker, connection, EPOLL_CTL_MOD, EPOLLIN);
+	return true;
+}
+
+//queues the inputs a client sent for the next tick, false when it left or sent something invalid
+int serverReceive(struct ServerWorker * worker, struct Connection * connection){
+	unsigned char data[256];
+	struct Room * room = connection->room;
+	while(true){
+		int got = recv(connection->fd, data, sizeof(data), MSG_DONTWAIT);
+		if(got == 0) return false;
+		if(got < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+		for(int i = 0; i < got; i++){
+			connection->in[connection->inLength] = data[i];
+			connection->inLength += 1;
+			if(connection->inLength < INPUT_MESSAGE_BYTES) continue;
+			connection->inLength = 0;
+			int type = connection->in[0];
+			int direction = connection->in[1];
+			unsigned int tick = 0;
+			for(int b = 0; b < 4; b++){
+				tick |= (unsigned int)connection->in[3 + b] << (b * 8);
+			}
+			if(type != INPUT_SELECT && (type != INPUT_DIRECTION || direction < UP || direction > RIGHT)) return false;
+			if(tick > (unsigned int)room->state.tick) return false;	//no client has seen that tick yet
+			if(room->inputCount == SERVER_ROOM_INPUTS){	//more than a tick can use
+				worker->droppedInputs += 1;
+				continue;
+			}
+			struct InputEvent * event = &room->inputs[room->inputCount];
+			room->inputCount += 1;
+			event->tick = tick;
+			event->type = type;
+			event->side = connection->side;
+			event->direction = (type == INPUT_DIRECTION) ? direction : NONE;
+			event->half = connection->in[2] != 0;
+			event->x = 0;
+			event->y = 0;
+		}
+	}
+}
+
+void closeRoom(struct Room * room){
+	if(room->closed) return;
+	room->closed = true;
+	for(int side = FIRST; side <= SECOND; side++){
+		close(room->player[side].fd);	//also takes it out of the epoll set
+		free(room->player[side].out);
+		room->player[side].out = 0;
+	}
+}
+
+//the tiles changed since the last delta, in map order, and the cursors if they moved
+int buildDelta(struct Room * room, unsigned char * buffer){
+	struct GameState * state = &room->state;
+	unsigned char * p = beginMessage(buffer, MESSAGE_DELTA);
+	p = putVarint(p, room->ticks);
+	int count = 0;
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		unsigned long long words = state->changedWords[s];
+		while(words){
+			count += __builtin_popcountll(state->changedBoard.word[s * 64 + __builtin_ctzll(words)]);
+			words &= words - 1;
+		}
+	}
+	p = putVarint(p, count);
+	
+	int last = -1;
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		unsigned long long words = state->changedWords[s];
+		state->changedWords[s] = 0;
+		while(words){
+			int w = s * 64 + __builtin_ctzll(words);
+			words &= words - 1;
+			unsigned long long bits = state->changedBoard.word[w];
+			state->changedBoard.word[w] = 0;
+			while(bits){
+				int index = w * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				int x = index % GRID_X;
+				int y = index / GRID_X;
+				struct Tile * tile = getTile(state, x, y);
+				int mapIndex = y * state->width + x;
+				p = putVarint(p, mapIndex - last - 1);
+				last = mapIndex;
+				*p++ = tile->faction;
+				p = putVarint(p, tile->unitCount);
+			}
+		}
+	}
+	
+	int moved = false;
+	for(int side = FIRST; side <= SECOND; side++){
+		int * shown = room->shownCursor[side];
+		if(shown[0] != state->cursorX[side] || shown[1] != state->cursorY[side] || shown[2] != state->isSelecting[side]){
+			moved = true;
+		}
+	}
+	*p++ = moved;
+	if(moved){
+		for(int side = FIRST; side <= SECOND; side++){
+			int * shown = room->shownCursor[side];
+			shown[0] = state->cursorX[side];
+			shown[1] = state->cursorY[side];
+			shown[2] = state->isSelecting[side];
+			p = putVarint(p, shown[0]);
+			p = putVarint(p, shown[1]);
+			*p++ = shown[2];
+		}
+	}
+	return endMessage(buffer, p);
+}
+
+int sendToRoom(struct ServerWorker * worker, struct Room * room, int length){
+	for(int side = FIRST; side <= SECOND; side++){
+		if(!serverSend(worker, &room->player[side], worker->message, length)){
+			closeRoom(room);
+			return false;
+		}
+	}
+	return true;
+}
+
+void openRoom(struct ServerWorker * worker, struct RoomRequest * request){
+	struct Room * room = malloc(sizeof(struct Room));
+	gameInit(&room->state, serverWidth, serverHeight, request->seed);
+	room->inputCount = 0;
+	room->ticks = 0;
+	room->closed = false;
+	snapshotReset(&room->history);
+	room->next = worker->rooms;
+	worker->rooms = room;
+	for(int side = FIRST; side <= SECOND; side++){
+		struct Connection * connection = &room->player[side];
+		connection->fd = request->fd[side - FIRST];
+		connection->side = side;
+		connection->room = room;
+		connection->inLength = 0;
+		connection->out = 0;
+		connection->outStart = 0;
+		connection->outLength = 0;
+		room->shownCursor[side][0] = -1;	//the first delta carries the cursors
+		prepareSocket(connection->fd);
+		watchConnection(worker, connection, EPOLL_CTL_ADD, EPOLLIN);
+	}
+	for(int side = FIRST; side <= SECOND; side++){
+		unsigned char * p = beginMessage(worker->message, MESSAGE_WELCOME);
+		*p++ = side;
+		p = putVarint(p, serverWidth);
+		p = putVarint(p, serverHeight);
+		for(int i = 0; i < 4; i++){
+			*p++ = request->seed >> (i * 8);
+		}
+		p = putVarint(p, serverTickMs);
+		if(!serverSend(worker, &room->player[side], worker->message, endMessage(worker->message, p))){
+			closeRoom(room);
+			return;
+		}
+	}
+}
+
+//files an input under the tick it was made at, false when that tick has no room for it
+int fileInput(struct Room * room, struct InputEvent * event){
+	int slot = event->tick % SNAPSHOT_FRAMES;
+	if(room->appliedCount[slot] == SERVER_ROOM_INPUTS) return false;
+	room->applied[slot][room->appliedCount[slot]] = *event;
+	room->appliedCount[slot] += 1;
+	return true;
+}
+
+//goes back to the start of a tick and simulates up to now again with the inputs filed since.
+//the replayed ticks mark every tile they touch, so the changes from before are put back
+//and only the tiles that end up different are added to them
+void rollbackRoom(struct ServerWorker * worker, struct Room * room, int tick){
+	struct GameState * state = &room->state;
+	int now = state->tick;
+	memcpy(worker->rewound, state, snapshotBytes(state));
+	snapshotRestore(&room->history, state, tick);
+	while(state->tick < now){
+		int slot = state->tick % SNAPSHOT_FRAMES;
+		for(int i = 0; i < room->appliedCount[slot]; i++){
+			gameApplyInput(state, &room->applied[slot][i]);
+		}
+		gameStep(state, 1);
+		if(state->winner != NONE) break;	//the tick stops counting with a winner
+		snapshotSave(&room->history, state);
+	}
+	
+	//a tile can only differ if the ticks touched it the first time or now
+	unsigned long long touched[BB_SUMMARY_WORDS];
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		touched[s] = state->changedWords[s];
+		for(int t = tick; t < now; t++){
+			touched[s] |= room->tickWords[t % SNAPSHOT_FRAMES][s];
+		}
+		for(int t = tick; t < now; t++){
+			room->tickWords[t % SNAPSHOT_FRAMES][s] = touched[s];	//the replayed ticks may touch other tiles than before
+		}
+	}
+	state->changedBoard = worker->rewound->changedBoard;
+	memcpy(state->changedWords, worker->rewound->changedWords, sizeof(state->changedWords));
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		unsigned long long words = touched[s];
+		while(words){
+			int w = s * 64 + __builtin_ctzll(words);
+			words &= words - 1;
+			for(int index = w * 64; index < w * 64 + 64; index++){
+				int x = index % GRID_X;
+				int y = index / GRID_X;
+				if(x >= state->width || y >= state->height) continue;
+				struct Tile * tile = getTile(state, x, y);
+				struct Tile * before = getTile(worker->rewound, x, y);
+				if(tile->faction != before->faction || tile->unitCount != before->unitCount){
+					setTileUnitCount(state, x, y, tile->unitCount);
+				}
+			}
+		}
+	}
+	worker->rollbacks += 1;
+	worker->replayedTicks += now - tick;
+}
+
+//applies the inputs that came in since the last tick, runs the tick and sends what changed
+void tickRoom(struct ServerWorker * worker, struct Room * room){
+	struct GameState * state = &room->state;
+	int now = state->tick;
+	snapshotSave(&room->history, state);
+	room->appliedCount[now % SNAPSHOT_FRAMES] = 0;
+	int oldest = snapshotOldestTick(&room->history);
+	int rewindTo = now;
+	for(int i = 0; i < room->inputCount; i++){
+		struct InputEvent * event = &room->inputs[i];
+		if(event->tick < oldest){
+			event->tick = now;
+			worker->staleInputs += 1;
+		}
+		if(fileInput(room, event)){
+			rewindTo = MIN(rewindTo, event->tick);
+		}else{
+			worker->droppedInputs += 1;
+		}
+	}
+	room->inputCount = 0;
+	if(rewindTo < now){
+		rollbackRoom(worker, room, rewindTo);
+	}
+	if(state->winner == NONE){
+		for(int i = 0; i < room->appliedCount[now % SNAPSHOT_FRAMES]; i++){
+			gameApplyInput(state, &room->applied[now % SNAPSHOT_FRAMES][i]);
+		}
+		gameStep(state, 1);
+	}
+	memcpy(room->tickWords[now % SNAPSHOT_FRAMES], state->changedWords, sizeof(state->changedWords));
+	room->ticks += 1;
+	if(!sendToRoom(worker, room, buildDelta(room, worker->message))) return;
+	
+	if(gameGetWinner(state) != NONE){
+		unsigned char * p = beginMessage(worker->message, MESSAGE_END);
+		*p++ = gameGetWinner(state);
+		sendToRoom(worker, room, endMessage(worker->message, p));
+		worker->finished += 1;
+		closeRoom(room);
+	}
+}
+
+void * serverThread(void * argument){
+	struct ServerWorker * worker = argument;
+	struct epoll_event events[SERVER_EVENTS];
+	double period = serverTickMs / 1000.0;
+	double deadline = getSeconds() + period;
+	while(serverRunning){
+		int wait = (int)ceil((deadline - getSeconds()) * 1000);
+		int ready = epoll_wait(worker->epoll, events, SERVER_EVENTS, MAX(wait, 0));
+		for(int i = 0; i < ready; i++){
+			struct Connection * connection = events[i].data.ptr;
+			if(connection == 0){
+				struct RoomRequest request;
+				while(read(worker->pipe[0], &request, sizeof(request)) == sizeof(request)){
+					openRoom(worker, &request);
+				}
+				continue;
+			}
+			if(connection->room->closed) continue;	//closed by an earlier event of this wait
+			int alive = (events[i].events & (EPOLLERR | EPOLLHUP)) == 0;
+			if(alive && (events[i].events & EPOLLOUT)){
+				alive = serverFlush(worker, connection);
+			}
+			if(alive && (events[i].events & EPOLLIN)){
+				alive = serverReceive(worker, connection);
+			}
+			if(!alive){
+				closeRoom(connection->room);
+			}
+		}
+		
+		//like the board, a late tick is caught up on right away and the clock never drifts
+		double now = getSeconds();
+		if(now >= deadline){
+			if(now - deadline >= period){
+				worker->lateTicks += 1;
+			}
+			for(struct Room * room = worker->rooms; room; room = room->next){
+				if(room->closed) continue;
+				tickRoom(worker, room);
+				worker->latency[worker->latencyCount % SERVER_LATENCY_SAMPLES] = (getSeconds() - deadline) * 1000;
+				worker->latencyCount += 1;
+			}
+			worker->ticks += 1;
+			deadline += period;
+		}
+		
+		struct Room ** link = &worker->rooms;
+		while(*link){
+			struct Room * room = *link;
+			if(room->closed){
+				*link = room->next;
+				free(room);
+			}else{
+				link = &room->next;
+			}
+		}
+	}
+	while(worker->rooms){
+		struct Room * room = worker->rooms;
+		worker->rooms = room->next;
+		closeRoom(room);
+		free(room);
+	}
+	return 0;
+}
+
+int compareFloats(const void * a, const void * b){
+	float x = *(const float *)a;
+	float y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+int runServer(int argc, char ** argv){
+	int port = SERVER_PORT;
+	int threads = aiThreadCount;
+	double seconds = 0;
+	for(int i = 0; i < argc; i++){
+		if(i + 1 >= argc){
+			fprintf(stderr, "%s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(strcmp(argv[i], "-port") == 0){
+			port = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-threads") == 0){
+			threads = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-tick-ms") == 0){
+			serverTickMs = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-seconds") == 0){
+			seconds = atof(argv[++i]);
+		}else if(strcmp(argv[i], "-size") == 0){
+			sscanf(argv[++i], "%dx%d", &serverWidth, &serverHeight);
+		}else if(strcmp(argv[i], "-seed") == 0){
+			serverSeed = strtoul(argv[++i], 0, 0);
+		}else{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(threads < 1) threads = 1;
+	if(threads > SERVER_MAX_THREADS) threads = SERVER_MAX_THREADS;
+	if(serverTickMs < 1) serverTickMs = 1;
+	if(serverWidth < 2 || serverWidth > GRID_X || serverHeight < 2 || serverHeight > GRID_Y){
+		fprintf(stderr, "map size must be between 2x2 and %dx%d\n", GRID_X, GRID_Y);
+		return 1;
+	}
+	
+	raiseFileLimit();
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if(bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0){
+		perror("server");
+		return 1;
+	}
+	
+	serverRunning = true;
+	for(int t = 0; t < threads; t++){
+		struct ServerWorker * worker = &serverWorker[t];
+		memset(worker, 0, sizeof(struct ServerWorker));
+		worker->epoll = epoll_create1(0);
+		if(pipe(worker->pipe) < 0){
+			perror("server");
+			return 1;
+		}
+		fcntl(worker->pipe[0], F_SETFL, O_NONBLOCK);
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = 0;
+		epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->pipe[0], &event);
+		worker->message = malloc(DELTA_MAX_BYTES);
+		worker->rewound = malloc(sizeof(struct GameState));
+		worker->latency = malloc(SERVER_LATENCY_SAMPLES * sizeof(float));
+		pthread_create(&worker->thread, 0, serverThread, worker);
+	}
+	printf("serving %dx%d matches on port %d with %d threads, a tick every %d ms\n", serverWidth, serverHeight, port, threads, serverTickMs);
+	fflush(stdout);
+	
+	//consecutive connections play each other, rooms go to the workers in turn
+	int waiting = -1;
+	int rooms = 0;
+	double start = getSeconds();
+	while(seconds == 0 || getSeconds() - start < seconds){
+		struct pollfd listening = {listener, POLLIN, 0};
+		if(poll(&listening, 1, 100) <= 0) continue;
+		int fd = accept(listener, 0, 0);
+		if(fd < 0) continue;
+		if(waiting == -1){
+			waiting = fd;
+			continue;
+		}
+		struct RoomRequest request = {{waiting, fd}, getMatchSeed(serverSeed, rooms)};
+		if(write(serverWorker[rooms % threads].pipe[1], &request, sizeof(request)) != sizeof(request)){
+			close(waiting);
+			close(fd);
+		}
+		rooms += 1;
+		waiting = -1;
+	}
+	serverRunning = false;
+	
+	long long ticks = 0;
+	long long lateTicks = 0;
+	long long rollbacks = 0;
+	long long replayedTicks = 0;
+	long long staleInputs = 0;
+	long long droppedInputs = 0;
+	long long messages = 0;
+	long long bytes = 0;
+	long long samples = 0;
+	int dropped = 0;
+	int finished = 0;
+	float * latency = malloc((long long)threads * SERVER_LATENCY_SAMPLES * sizeof(float));
+	for(int t = 0; t < threads; t++){
+		struct ServerWorker * worker = &serverWorker[t];
+		pthread_join(worker->thread, 0);
+		ticks += worker->latencyCount;
+		lateTicks += worker->lateTicks;
+		rollbacks += worker->rollbacks;
+		replayedTicks += worker->replayedTicks;
+		staleInputs += worker->staleInputs;
+		droppedInputs += worker->droppedInputs;
+		messages += worker->messages;
+		bytes += worker->bytes;
+		dropped += worker->dropped;
+		finished += worker->finished;
+		long long kept = MIN(worker->latencyCount, SERVER_LATENCY_SAMPLES);
+		memcpy(latency + samples, worker->latency, kept * sizeof(float));
+		samples += kept;
+		close(worker->epoll);
+		free(worker->message);
+		free(worker->rewound);
+		free(worker->latency);
+	}
+	close(listener);
+	if(waiting != -1) close(waiting);
+	
+	double elapsed = getSeconds() - start;
+	printf("%d rooms in %.1f s, %d finished, %d slow clients dropped\n", rooms, elapsed, finished, dropped);
+	printf("%lld room ticks, %lld worker ticks started a period late\n", ticks, lateTicks);
+	printf("%lld rollbacks replayed %lld ticks, %lld inputs were too late to roll back, %lld were dropped as the tick was full\n",
+		rollbacks, replayedTicks, staleInputs, droppedInputs);
+	printf("%lld messages, %.1f bytes per message, %.1f KB/s\n", messages, messages ? (double)bytes / messages : 0.0, bytes / elapsed / 1024);
+	if(samples > 0){
+		qsort(latency, samples, sizeof(float), compareFloats);
+		printf("tick latency ms: p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n", latency[samples / 2], latency[samples * 9 / 10],
+			latency[samples * 99 / 100], latency[samples * 999 / 1000], latency[samples - 1]);
+	}
+	free(latency);
+	return 0;
+}
+
+//a player of the load generator, it presses random keys and checks every message it gets
+struct LoadClient{
+	int fd;
+	int side;			//NONE until welcomed
+	int width;
+	int height;
+	int lastTick;
+	unsigned char * in;
+	int inLength;
+	double nextInput;
+};
+
+struct LoadWorker{
+	pthread_t thread;
+	int first;
+	int count;
+	unsigned int random;
+	long long deltas;
+	long long bytes;
+	long long gaps;		//deltas that did not follow the last tick
+	int errors;			//malformed messages and lost connections
+	int ended;			//matches that reached their end message
+};
+
+struct LoadClient * loadClients;
+char * loadHost = "127.0.0.1";
+int loadPort = SERVER_PORT;
+int loadInputs = 4;		//per client and second
+int loadLate;			//ticks before the last delta inputs are stamped with, like a client that far behind
+volatile int loadRunning;
+
+int loadConnect(struct LoadClient * client, int epoll){
+	client->fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(loadPort);
+	inet_pton(AF_INET, loadHost, &address.sin_addr);
+	if(connect(client->fd, (struct sockaddr *)&address, sizeof(address)) < 0){
+		perror("loadgen");
+		close(client->fd);
+		return false;
+	}
+	prepareSocket(client->fd);
+	client->side = NONE;
+	client->lastTick = -1;
+	client->inLength = 0;
+	client->nextInput = getSeconds();
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = client;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, client->fd, &event);
+	return true;
+}
+
+//false when the message is malformed
+int loadMessage(struct LoadWorker * worker, struct LoadClient * client, int type, unsigned char * p, unsigned char * end){
+	unsigned int value;
+	if(type == MESSAGE_WELCOME){
+		if(p == end) return false;
+		client->side = *p++;
+		if(!(p = getVarint(p, end, &value))) return false;
+		client->width = value;
+		if(!(p = getVarint(p, end, &value))) return false;
+		client->height = value;
+		return client->width > 0 && client->height > 0;
+	}
+	if(type == MESSAGE_DELTA){
+		if(!(p = getVarint(p, end, &value))) return false;
+		if(client->lastTick != -1 && (int)value != client->lastTick + 1){
+			worker->gaps += 1;
+		}
+		client->lastTick = value;
+		unsigned int count;
+		if(!(p = getVarint(p, end, &count))) return false;
+		int index = -1;
+		for(unsigned int i = 0; i < count; i++){
+			if(!(p = getVarint(p, end, &value))) return false;
+			index += value + 1;
+			if(index >= client->width * client->height || p == end || *p++ > SECOND) return false;
+			if(!(p = getVarint(p, end, &value)) || value > MAX_UNIT) return false;
+		}
+		worker->deltas += 1;
+		return p < end;
+	}
+	return type == MESSAGE_END;
+}
+
+//reads what arrived, true while the connection should stay open
+int loadReceive(struct LoadWorker * worker, struct LoadClient * client){
+	while(true){
+		int got = recv(client->fd, client->in + client->inLength, DELTA_MAX_BYTES - client->inLength, MSG_DONTWAIT);
+		if(got == 0){
+			worker->errors += 1;
+			return false;
+		}
+		if(got < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+			worker->errors += 1;
+			return false;
+		}
+		worker->bytes += got;
+		client->inLength += got;
+		
+		int used = 0;
+		while(client->inLength - used >= 4){
+			unsigned char * message = client->in + used;
+			unsigned int length = message[0] | (message[1] << 8) | (message[2] << 16) | ((unsigned int)message[3] << 24);
+			if(length < 1 || length > DELTA_MAX_BYTES - 4){
+				worker->errors += 1;
+				return false;
+			}
+			if(client->inLength - used < 4 + (int)length) break;
+			if(!loadMessage(worker, client, message[4], message + MESSAGE_HEADER, message + 4 + length)){
+				worker->errors += 1;
+				return false;
+			}
+			used += 4 + length;
+			if(message[4] == MESSAGE_END){
+				worker->ended += 1;
+				return false;
+			}
+		}
+		memmove(client->in, client->in + used, client->inLength - used);
+		client->inLength -= used;
+	}
+}
+
+void * loadThread(void * argument){
+	struct LoadWorker * worker = argument;
+	struct epoll_event events[SERVER_EVENTS];
+	int epoll = epoll_create1(0);
+	for(int i = worker->first; i < worker->first + worker->count; i++){
+		loadClients[i].in = malloc(DELTA_MAX_BYTES);
+		loadClients[i].fd = -1;
+		loadConnect(&loadClients[i], epoll);
+	}
+	while(loadRunning){
+		int ready = epoll_wait(epoll, events, SERVER_EVENTS, 5);
+		for(int i = 0; i < ready; i++){
+			struct LoadClient * client = events[i].data.ptr;
+			if(!loadReceive(worker, client)){
+				close(client->fd);
+				client->fd = -1;
+				if(loadRunning) loadConnect(client, epoll);	//and plays the next match
+			}
+		}
+		
+		double now = getSeconds();
+		for(int i = worker->first; i < worker->first + worker->count; i++){
+			struct LoadClient * client = &loadClients[i];
+			if(client->fd == -1 || client->side == NONE || now < client->nextInput) continue;
+			client->nextInput = MAX(client->nextInput + 1.0 / loadInputs, now - 1.0);
+			worker->random = worker->random * 1664525u + 1013904223u;
+			unsigned int r = worker->random >> 16;
+			unsigned int tick = MAX(client->lastTick - loadLate, 0);
+			unsigned char input[INPUT_MESSAGE_BYTES] = {INPUT_DIRECTION, UP + r % 4, (r >> 2) & 1, tick, tick >> 8, tick >> 16, tick >> 24};
+			if(r % 5 == 0){
+				input[0] = INPUT_SELECT;
+			}
+			send(client->fd, input, sizeof(input), MSG_NOSIGNAL | MSG_DONTWAIT);
+		}
+	}
+	for(int i = worker->first; i < worker->first + worker->count; i++){
+		if(loadClients[i].fd != -1) close(loadClients[i].fd);
+		free(loadClients[i].in);
+	}
+	close(epoll);
+	return 0;
+}
+
+int runLoadGenerator(int argc, char ** argv){
+	int rooms = 100;
+	int threads = aiThreadCount;
+	double seconds = 10;
+	for(int i = 0; i < argc; i++){
+		if(i + 1 >= argc){
+			fprintf(stderr, "%s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(strcmp(argv[i], "-host") == 0){
+			loadHost = argv[++i];
+		}else if(strcmp(argv[i], "-port") == 0){
+			loadPort = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-rooms") == 0){
+			rooms = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-threads") == 0){
+			threads = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-seconds") == 0){
+			seconds = atof(argv[++i]);
+		}else if(strcmp(argv[i], "-inputs") == 0){
+			loadInputs = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-late") == 0){
+			loadLate = atoi(argv[++i]);
+		}else{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(rooms < 1) rooms = 1;
+	if(loadInputs < 1) loadInputs = 1;
+	if(threads < 1) threads = 1;
+	if(threads > SERVER_MAX_THREADS) threads = SERVER_MAX_THREADS;
+	
+	raiseFileLimit();
+	int clients = rooms * 2;
+	loadClients = calloc(clients, sizeof(struct LoadClient));
+	struct LoadWorker * workers = calloc(threads, sizeof(struct LoadWorker));
+	loadRunning = true;
+	double start = getSeconds();
+	for(int t = 0; t < threads; t++){
+		workers[t].first = clients * t / threads;
+		workers[t].count = clients * (t + 1) / threads - workers[t].first;
+		workers[t].random = t + 1;
+		pthread_create(&workers[t].thread, 0, loadThread, &workers[t]);
+	}
+	while(getSeconds() - start < seconds){
+		usleep(10000);
+	}
+	loadRunning = false;
+	
+	long long deltas = 0;
+	long long bytes = 0;
+	long long gaps = 0;
+	int errors = 0;
+	int ended = 0;
+	for(int t = 0; t < threads; t++){
+		pthread_join(workers[t].thread, 0);
+		deltas += workers[t].deltas;
+		bytes += workers[t].bytes;
+		gaps += workers[t].gaps;
+		errors += workers[t].errors;
+		ended += workers[t].ended;
+	}
+	double elapsed = getSeconds() - start;
+	printf("%d clients in %d rooms for %.1f s, %d inputs per second each\n", clients, rooms, elapsed, loadInputs);
+	printf("%.0f deltas/s, %.1f KB/s received, %lld tick gaps, %d matches ended, %d errors\n",
+		deltas / elapsed, bytes / elapsed / 1024, gaps, ended, errors);
+	free(workers);
+	free(loadClients);
+	return 0;
+}
+
+/* ↑↑↑ Match Server ↑↑↑ */
+#endif
+
+
+#ifndef GENERAL_LIBRARY
+/* ↓↓↓ Host Emulator ↓↓↓ */
+//stands in for the DE1-SoC devices behind the hal functions so the whole game loop runs natively,
+//time only moves at a buffer swap: every vertical sync the game waits for is one frame of 1/60 s
+//./generalio emulate [-frames n] [-script file] [-dump prefix] [-dump-every n] [-stats file] [-switch n] [-switches n] [-record file] [-wav file]
+//./generalio replay file [-repeat n] [-render-every ticks] [-render-final] [-dump prefix]
+
+#define EMU_ONCHIP_BYTES 0x40000
+#define EMU_SDRAM_BYTES 0x40000	//only the part the back buffer uses
+#define EMU_CHAR_BYTES 0x2000
+#define EMU_FPGA_BYTES 0x10000		//lightweight bridge devices from LEDR_BASE
+#define EMU_MPCORE_BYTES 0x2000		//private timer and GIC from 0xFFFEC000
+#define EMU_PS2_FIFO_SIZE 256		//same depth as the real controller
+#define EMU_SCRIPT_SIZE 4096
+
+//one scripted device event, a ps2 byte or a press of button 0
+struct EmuEvent{
+	int frame;
+	int ps2Byte;	//-1 for a button press
+};
+
+unsigned char emuOnchip[EMU_ONCHIP_BYTES] __attribute__((aligned(8)));
+unsigned char emuSdram[EMU_SDRAM_BYTES] __attribute__((aligned(8)));
+unsigned char emuChar[EMU_CHAR_BYTES] __attribute__((aligned(8)));
+unsigned char emuFpga[EMU_FPGA_BYTES] __attribute__((aligned(8)));
+unsigned char emuMpcore[EMU_MPCORE_BYTES] __attribute__((aligned(8)));
+
+unsigned char emuPs2Fifo[EMU_PS2_FIFO_SIZE];
+int emuPs2Head;
+int emuPs2Count;
+
+struct EmuEvent emuScript[EMU_SCRIPT_SIZE];
+int emuScriptCount;
+int emuScriptNext;
+
+int emuFrame;			//buffer swaps so far
+int emuFrameLimit = 600;
+int emuSwapPending;
+int emuSwitchPeriod = 1000;	//switch 0 flips every this many reads, which is what the randomizer waits for
+int emuSwitches;			//the other switches
+unsigned int emuSwitchReads;
+
+//mmio accesses of the frame being drawn, buffer writes count every store into the pixel and character buffers
+int emuRegisterReads;
+int emuRegisterWrites;
+int emuBufferWrites;
+unsigned long long emuTotalRegisterReads;
+unsigned long long emuTotalRegisterWrites;
+unsigned long long emuTotalBufferWrites;
+
+int emuDumpEvery;
+char * emuDumpPrefix = "frame";
+FILE * emuStatsFile;
+
+//the codec fifo, and what the codec played when a wav is recorded
+int emuAudioFifo[AUDIO_FIFO_SIZE];
+int emuAudioHead;
+int emuAudioCount;
+int emuAudioRemainder;		//of AUDIO_RATE / FRAME_HZ samples per frame
+int emuAudioUnderruns;		//samples played as silence while the game asked for more
+short * emuWav;
+int emuWavLength;
+int emuWavCapacity;
+
+void emuAdvance(int cycles);
+void emuRaiseIRQ(int irqID);
+void emuDeliverScript();
+void emuDumpFrame();
+void emuPlayAudio(int samples);
+
+//the host memory behind a device address, exits like a data abort for anything else
+char * halMemory(unsigned int address){
+	if(address >= FPGA_ONCHIP_BASE && address < FPGA_ONCHIP_BASE + EMU_ONCHIP_BYTES){
+		return (char *)&emuOnchip[address - FPGA_ONCHIP_BASE];
+	}
+	if(address >= SDRAM_BASE && address < SDRAM_BASE + EMU_SDRAM_BYTES){
+		return (char *)&emuSdram[address - SDRAM_BASE];
+	}
+	if(address >= FPGA_CHAR_BASE && address < FPGA_CHAR_BASE + EMU_CHAR_BYTES){
+		return (char *)&emuChar[address - FPGA_CHAR_BASE];
+	}
+	if(address >= LEDR_BASE && address < LEDR_BASE + EMU_FPGA_BYTES){
+		return (char *)&emuFpga[address - LEDR_BASE];
+	}
+	if(address >= 0xFFFEC000 && address < 0xFFFEC000 + EMU_MPCORE_BYTES){
+		return (char *)&emuMpcore[address - 0xFFFEC000];
+	}
+	fprintf(stderr, "emulator: access to unmapped address 0x%08X\n", address);
+	exit(1);
+}
+
+int * emuRegister(unsigned int address){
+	return (int *)halMemory(address);
+}
+
+int isBufferAddress(unsigned int address){
+	return address >= SDRAM_BASE && address < LEDR_BASE;
+}
+
+void halCountStores(int count){
+	emuBufferWrites += count;
+}
+
+int halRunning(){
+	return emuFrame < emuFrameLimit;
+}
+
+//emulated time stands still while the game works, so frames are timed with the host clock instead
+unsigned int halCycles(){
+	return (unsigned int)(unsigned long long)(getSeconds() * CPU_HZ);
+}
+
+unsigned int halCounter(){
+	return halCycles();
+}
+
+//registers whose value changes by being read
+void emuBeforeRead(unsigned int address){
+	address &= ~3;
+	if(isBufferAddress(address)){
+		return;
+	}
+	emuRegisterReads += 1;
+	if(address == PIXEL_BUF_CTRL_BASE + 12 && emuSwapPending){
+		//the game is waiting for the swap, so this is where the frame ends
+		int front = *emuRegister(PIXEL_BUF_CTRL_BASE);
+		*emuRegister(PIXEL_BUF_CTRL_BASE) = *emuRegister(PIXEL_BUF_CTRL_BASE + 4);
+		*emuRegister(PIXEL_BUF_CTRL_BASE + 4) = front;
+		*emuRegister(PIXEL_BUF_CTRL_BASE + 12) &= ~1;
+		emuSwapPending = false;
+
+		emuFrame += 1;
+		if(emuDumpEvery > 0 && emuFrame % emuDumpEvery == 0){
+			emuDumpFrame();
+		}
+		if(emuStatsFile){
+			fprintf(emuStatsFile, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", emuFrame, emuRegisterReads, emuRegisterWrites, emuBufferWrites,
+				framePixelWrites, frameCharWrites, framePixelWritesSaved, frameCharWritesSaved, game.tick, tickLag, frameBudgetUsed);
+		}
+		emuTotalRegisterReads += emuRegisterReads;
+		emuTotalRegisterWrites += emuRegisterWrites;
+		emuTotalBufferWrites += emuBufferWrites;
+		emuRegisterReads = 0;
+		emuRegisterWrites = 0;
+		emuBufferWrites = 0;
+
+		emuAdvance(FRAME_CYCLES);
+		emuAudioRemainder += AUDIO_RATE;
+		emuPlayAudio(emuAudioRemainder / FRAME_HZ);
+		emuAudioRemainder %= FRAME_HZ;
+		emuDeliverScript();
+	}else if(address == PS2_BASE){
+		int data = 0;
+		if(emuPs2Count > 0){
+			data = emuPs2Fifo[emuPs2Head] | 0x8000 | ((emuPs2Count - 1) << 16);	//RVALID and RAVAIL
+			emuPs2Head = (emuPs2Head + 1) % EMU_PS2_FIFO_SIZE;
+			emuPs2Count -= 1;
+		}
+		*emuRegister(PS2_BASE) = data;
+	}else if(address == SW_BASE){
+		*emuRegister(SW_BASE) = (emuSwitches & ~1) | ((emuSwitchReads / emuSwitchPeriod) & 1);
+		emuSwitchReads += 1;
+	}else if(address == AUDIO_BASE + 4){
+		int space = AUDIO_FIFO_SIZE - emuAudioCount;
+		*emuRegister(AUDIO_BASE + 4) = (int)(((unsigned int)space << 24) | ((unsigned int)space << 16));
+	}
+}
+
+//registers with side effects on a write, returns false when the value should not be stored as written
+int emuBeforeWrite(unsigned int address, int value){
+	address &= ~3;
+	if(isBufferAddress(address)){
+		emuBufferWrites += 1;
+		return true;
+	}
+	emuRegisterWrites += 1;
+	if(address == PIXEL_BUF_CTRL_BASE){
+		//asks for a swap at the next vertical sync, the front buffer register itself is read only
+		emuSwapPending = true;
+		*emuRegister(PIXEL_BUF_CTRL_BASE + 12) |= 1;
+		return false;
+	}else if(address == MPCORE_PRIV_TIMER){
+		*emuRegister(MPCORE_PRIV_TIMER + 4) = value;	//writing the load also restarts the count
+	}else if(address == AUDIO_BASE && (value & 0b1000)){
+		emuAudioCount = 0;	//clears the write fifo
+	}else if(address == AUDIO_BASE + 12){
+		//both channels carry the same mix, the right one completes a sample
+		if(emuAudioCount < AUDIO_FIFO_SIZE){
+			emuAudioFifo[(emuAudioHead + emuAudioCount) % AUDIO_FIFO_SIZE] = value;
+			emuAudioCount += 1;
+		}
+	}else if(address == MPCORE_PRIV_TIMER + 12 || address == KEY_BASE + 12){
+		*emuRegister(address) &= ~value;	//interrupt status and edge capture clear on a written 1
+		return false;
+	}
+	return true;
+}
+
+int halRead32(unsigned int address){
+	emuBeforeRead(address);
+	return *(int *)halMemory(address);
+}
+
+int halRead16(unsigned int address){
+	emuBeforeRead(address);
+	return *(short *)halMemory(address);
+}
+
+int halRead8(unsigned int address){
+	emuBeforeRead(address);
+	return *(char *)halMemory(address);
+}
+
+void halWrite32(unsigned int address, int value){
+	if(emuBeforeWrite(address, value)){
+		*(int *)halMemory(address) = value;
+	}
+}
+
+void halWrite16(unsigned int address, int value){
+	if(emuBeforeWrite(address, value)){
+		*(short *)halMemory(address) = value;
+	}
+}
+
+void halWrite8(unsigned int address, int value){
+	if(emuBeforeWrite(address, value)){
+		*(char *)halMemory(address) = value;
+	}
+}
+
+//an interrupt only reaches the game if the gic was set up to pass it on
+void emuRaiseIRQ(int irqID){
+	int enabled = *emuRegister(MPCORE_GIC_DIST + 0x100 + (irqID >> 5) * 4) & (1 << (irqID & 31));
+	if(enabled && *emuRegister(MPCORE_GIC_DIST) && *emuRegister(MPCORE_GIC_CPUIF)){
+		handleIRQ(irqID);
+	}
+}
+
+//runs the private timer for the given amount of cycles
+void emuAdvance(int cycles){
+	int * load = emuRegister(MPCORE_PRIV_TIMER);
+	int * counter = emuRegister(MPCORE_PRIV_TIMER + 4);
+	int * control = emuRegister(MPCORE_PRIV_TIMER + 8);
+	int * status = emuRegister(MPCORE_PRIV_TIMER + 12);
+	while(cycles > 0 && (*control & 1)){
+		if((unsigned int)*counter >= (unsigned int)cycles){
+			*counter -= cycles;
+			return;
+		}
+		cycles -= *counter + 1;
+		if(*control & 2){
+			*counter = *load;
+		}else{
+			*counter = 0;
+			*control &= ~1;
+		}
+		*status |= 1;
+		if(*control & 4){
+			emuRaiseIRQ(29);
+		}
+	}
+}
+
+//the codec plays samples in small chunks and raises its interrupt whenever the fifo is
+//three quarters empty and the write interrupt is enabled
+void emuPlayAudio(int samples){
+	while(samples > 0){
+		int wanted = *emuRegister(AUDIO_BASE) & 0b10;
+		if(wanted && AUDIO_FIFO_SIZE - emuAudioCount >= AUDIO_FIFO_SIZE * 3 / 4){
+			emuRaiseIRQ(78);
+		}
+		int chunk = MIN(samples, AUDIO_FIFO_SIZE / 8);
+		for(int i = 0; i < chunk; i++){
+			int sample = 0;
+			if(emuAudioCount > 0){
+				sample = emuAudioFifo[emuAudioHead];
+				emuAudioHead = (emuAudioHead + 1) % AUDIO_FIFO_SIZE;
+				emuAudioCount -= 1;
+			}else if(wanted){
+				emuAudioUnderruns += 1;
+			}
+			if(emuWav){
+				if(emuWavLength == emuWavCapacity){
+					emuWavCapacity *= 2;
+					emuWav = realloc(emuWav, emuWavCapacity * sizeof(short));
+				}
+				emuWav[emuWavLength] = sample >> 16;
+				emuWavLength += 1;
+			}
+		}
+		samples -= chunk;
+	}
+}
+
+void putWavValue(FILE * file, unsigned int value, int bytes){
+	for(int i = 0; i < bytes; i++){
+		fputc((value >> (i * 8)) & 0xFF, file);
+	}
+}
+
+//16 bit mono at AUDIO_RATE
+int writeWav(char * path, short * samples, int count){
+	FILE * file = fopen(path, "wb");
+	if(!file){
+		perror(path);
+		return false;
+	}
+	fputs("RIFF", file);
+	putWavValue(file, 36 + count * 2, 4);
+	fputs("WAVEfmt ", file);
+	putWavValue(file, 16, 4);
+	putWavValue(file, 1, 2);		//pcm
+	putWavValue(file, 1, 2);		//channels
+	putWavValue(file, AUDIO_RATE, 4);
+	putWavValue(file, AUDIO_RATE * 2, 4);
+	putWavValue(file, 2, 2);
+	putWavValue(file, 16, 2);
+	fputs("data", file);
+	putWavValue(file, count * 2, 4);
+	for(int i = 0; i < count; i++){
+		putWavValue(file, (unsigned short)samples[i], 2);
+	}
+	fclose(file);
+	return true;
+}
+
+//hands the game everything the script holds for the frame that just started
+void emuDeliverScript(){
+	while(emuScriptNext < emuScriptCount && emuScript[emuScriptNext].frame <= emuFrame){
+		struct EmuEvent * event = &emuScript[emuScriptNext];
+		emuScriptNext += 1;
+		if(event->ps2Byte < 0){
+			*emuRegister(KEY_BASE + 12) |= 1;
+			if(*emuRegister(KEY_BASE + 8) & 1){
+				emuRaiseIRQ(73);
+			}
+		}else if(emuPs2Count < EMU_PS2_FIFO_SIZE){
+			emuPs2Fifo[(emuPs2Head + emuPs2Count) % EMU_PS2_FIFO_SIZE] = event->ps2Byte;
+			emuPs2Count += 1;
+		}
+	}
+	//the controller keeps its interrupt raised until the fifo is empty
+	while(emuPs2Count > 0 && (*emuRegister(PS2_BASE + 4) & 1)){
+		int before = emuPs2Count;
+		emuRaiseIRQ(79);
+		if(emuPs2Count == before) break;
+	}
+}
+
+//script lines are "<frame> key <hex bytes>" or "<frame> button", # starts a comment
+int emuLoadScript(char * path){
+	FILE * file = fopen(path, "r");
+	if(!file){
+		perror(path);
+		return false;
+	}
+	char line[256];
+	while(fgets(line, sizeof(line), file)){
+		char * comment = strchr(line, '#');
+		if(comment) *comment = 0;
+		int frame;
+		char command[16];
+		int used;
+		if(sscanf(line, "%d %15s%n", &frame, command, &used) != 2) continue;
+		if(strcmp(command, "button") == 0 && emuScriptCount < EMU_SCRIPT_SIZE){
+			emuScript[emuScriptCount].frame = frame;
+			emuScript[emuScriptCount].ps2Byte = -1;
+			emuScriptCount += 1;
+		}else if(strcmp(command, "key") == 0){
+			char * bytes = line + used;
+			unsigned int value;
+			int length;
+			while(sscanf(bytes, "%x%n", &value, &length) == 1 && emuScriptCount < EMU_SCRIPT_SIZE){
+				emuScript[emuScriptCount].frame = frame;
+				emuScript[emuScriptCount].ps2Byte = value & 0xFF;
+				emuScriptCount += 1;
+				bytes += length;
+			}
+		}else{
+			fprintf(stderr, "%s: unknown command %s\n", path, command);
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+//the front buffer as a binary ppm, and the character buffer next to it as text
+void emuDumpFrame(){
+	char path[512];
+	snprintf(path, sizeof(path), "%s%05d.ppm", emuDumpPrefix, emuFrame);
+	FILE * file = fopen(path, "wb");
+	if(!file){
+		perror(path);
+		return;
+	}
+	int width = *emuRegister(PIXEL_BUF_CTRL_BASE + 8) & 0xFFFF;
+	int height = *emuRegister(PIXEL_BUF_CTRL_BASE + 8) >> 16;
+	char * front = halMemory(*emuRegister(PIXEL_BUF_CTRL_BASE));
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	for(int y = 0; y < height; y++){
+		unsigned short * row = (unsigned short *)(front + y * PIXEL_ROW_BYTES);
+		for(int x = 0; x < width; x++){
+			unsigned char rgb[3];
+			rgb[0] = ((row[x] >> 11) & 0x1F) * 255 / 31;
+			rgb[1] = ((row[x] >> 5) & 0x3F) * 255 / 63;
+			rgb[2] = (row[x] & 0x1F) * 255 / 31;
+			fwrite(rgb, 1, 3, file);
+		}
+	}
+	fclose(file);
+
+	snprintf(path, sizeof(path), "%s%05d.txt", emuDumpPrefix, emuFrame);
+	file = fopen(path, "w");
+	if(!file){
+		perror(path);
+		return;
+	}
+	for(int y = 0; y < CHAR_BUF_HEIGHT; y++){
+		for(int x = 0; x < CHAR_BUF_WIDTH; x++){
+			char c = emuChar[y * CHAR_ROW_BYTES + x];
+			fputc((c >= ' ' && c <= '~') ? c : ' ', file);
+		}
+		fputc('\n', file);
+	}
+	fclose(file);
+}
+
+#ifdef ENABLE_PROFILER
+char * profileStageNames[PROFILE_STAGES] = {"tick", "animation", "grid", "highlights", "sync",
+	"ps2 irq", "timer irq", "button irq", "audio irq"};
+
+//the last full window, or what there is of the current one when the run was shorter
+void printProfile(){
+	if(profile[PROFILE_TICK].shownCount == 0){
+		profilePublish();
+	}
+	printf("%-13s %7s %9s %9s %9s\n", "stage", "calls", "min us", "avg us", "max us");
+	for(int i = 0; i < PROFILE_STAGES; i++){
+		struct ProfileStage * p = &profile[i];
+		if(p->shownCount == 0) continue;
+		printf("%-13s %7d %9.2f %9.2f %9.2f\n", profileStageNames[i], p->shownCount,
+			p->shownMin * 1e6 / CPU_HZ, p->shownAvg * 1e6 / CPU_HZ, p->shownMax * 1e6 / CPU_HZ);
+	}
+	printf("HEX shows %d frames per second and a tick lag of %d\n", MIN(profileFps, 9999), MIN(profileLag, 99));
+}
+#endif
+
+void emulatorUsage(){
+	fprintf(stderr, "usage: generalio emulate [-frames n] [-script file] [-dump prefix] [-dump-every n] [-stats file] [-switch n] [-switches n] [-record file] [-wav file]\n");
+}
+
+void emuPowerOn(){
+	*emuRegister(PIXEL_BUF_CTRL_BASE) = FPGA_ONCHIP_BASE;
+	*emuRegister(PIXEL_BUF_CTRL_BASE + 4) = FPGA_ONCHIP_BASE;
+	*emuRegister(PIXEL_BUF_CTRL_BASE + 8) = 320 | (240 << 16);
+}
+
+int emulateGame(int argc, char ** argv){
+	char * recordPath = 0;
+	char * wavPath = 0;
+	for(int i = 0; i < argc; i++){
+		if(i + 1 >= argc){
+			emulatorUsage();
+			return 1;
+		}
+		if(strcmp(argv[i], "-frames") == 0){
+			emuFrameLimit = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-script") == 0){
+			if(!emuLoadScript(argv[++i])) return 1;
+		}else if(strcmp(argv[i], "-dump") == 0){
+			emuDumpPrefix = argv[++i];
+			if(emuDumpEvery == 0) emuDumpEvery = FRAME_HZ;
+		}else if(strcmp(argv[i], "-dump-every") == 0){
+			emuDumpEvery = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-stats") == 0){
+			emuStatsFile = fopen(argv[++i], "w");
+			if(!emuStatsFile){
+				perror(argv[i]);
+				return 1;
+			}
+			fprintf(emuStatsFile, "frame,registerReads,registerWrites,bufferWrites,pixelWrites,charWrites,pixelWritesSaved,charWritesSaved,tick,tickLag,frameBudget\n");
+		}else if(strcmp(argv[i], "-switches") == 0){
+			emuSwitches = strtol(argv[++i], 0, 0);
+		}else if(strcmp(argv[i], "-switch") == 0){
+			emuSwitchPeriod = atoi(argv[++i]);
+			if(emuSwitchPeriod < 1) emuSwitchPeriod = 1;
+		}else if(strcmp(argv[i], "-record") == 0){
+			recordPath = argv[++i];
+		}else if(strcmp(argv[i], "-wav") == 0){
+			wavPath = argv[++i];
+			emuWavCapacity = AUDIO_RATE;
+			emuWav = malloc(emuWavCapacity * sizeof(short));
+		}else{
+			emulatorUsage();
+			return 1;
+		}
+	}
+
+	emuPowerOn();
+	double start = getSeconds();
+	irqSetupMain();
+	gameLoop();
+	double seconds = getSeconds() - start;
+
+	if(emuStatsFile) fclose(emuStatsFile);
+	int frames = (emuFrame > 0) ? emuFrame : 1;
+	printf("%d frames (%.1f s emulated) in %.3f s, %.0f frames/second\n", emuFrame, (double)emuFrame / FRAME_HZ, seconds, emuFrame / seconds);
+	printf("mmio per frame: %.1f register reads, %.1f register writes, %.1f buffer writes\n",
+		(double)emuTotalRegisterReads / frames, (double)emuTotalRegisterWrites / frames, (double)emuTotalBufferWrites / frames);
+	printf("writes saved against a full redraw: %llu pixel (%.1f per frame), %llu character (%.1f per frame)\n",
+		totalPixelWritesSaved, (double)totalPixelWritesSaved / frames, totalCharWritesSaved, (double)totalCharWritesSaved / frames);
+	printf("tick %d, peak tick lag %d, %d ticks spent lagging, dropped input events %d, winner %d, hash %08x\n", game.tick, peakTickLag,
+		laggingTicks, droppedInputEvents, gameGetWinner(&game), gameHash(&game));
+	printf("frame budget used: %.1f%% on average, %d%% peak, %d of %d frames over budget\n",
+		budgetFrames ? totalFrameWorkCycles * 100.0 / ((double)budgetFrames * FRAME_CYCLES) : 0.0, peakFrameBudgetUsed, overBudgetFrames, budgetFrames);
+#ifdef ENABLE_PROFILER
+	printProfile();
+#endif
+	if(wavPath){
+		if(!writeWav(wavPath, emuWav, emuWavLength)) return 1;
+		printf("%.1f s of audio written to %s, %d samples of underrun\n", (double)emuWavLength / AUDIO_RATE, wavPath, emuAudioUnderruns);
+	}
+	
+	//the replay of the last match, restarted by every button press
+	if(recordPath){
+		replayFinish(&currentReplay, game.tick);
+		FILE * file = fopen(recordPath, "wb");
+		if(!file){
+			perror(recordPath);
+			return 1;
+		}
+		fwrite(currentReplay.data, 1, currentReplay.length, file);
+		fclose(file);
+		printf("replay of %d bytes written to %s%s\n", currentReplay.length, recordPath, currentReplay.overflow ? ", cut short by a full buffer" : "");
+	}
+	return 0;
+}
+
+//shows the game as it is right now, without the counts easing in.
+//only changed tiles can show an old count, so only those are looked at
+void renderReplayFrame(){
+	for(int s = 0; s < BB_SUMMARY_WORDS; s++){
+		unsigned long long words = game.changedWords[s];
+		while(words){
+			int w = s * 64 + __builtin_ctzll(words);
+			words &= words - 1;
+			unsigned long long bits = game.changedBoard.word[w];
+			while(bits){
+				int index = w * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				struct Tile * tile = getTile(&game, index % GRID_X, index / GRID_X);
+				tile->animatedUnitCount = tile->unitCount;
+			}
+		}
+	}
+	doRender();
+	while(swapFinished() == false);
+}
+
+//plays a replay as fast as possible, optionally drawing a frame every so many ticks or only the last one
+int playReplay(int argc, char ** argv){
+	if(argc < 1){
+		fprintf(stderr, "usage: generalio replay file [-repeat n] [-render-every ticks] [-render-final] [-dump prefix]\n");
+		return 1;
+	}
+	int repeat = 1;
+	int renderEvery = 0;
+	int renderFinal = false;
+	char * dumpPrefix = 0;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-render-final") == 0){
+			renderFinal = true;
+		}else if(i + 1 < argc && strcmp(argv[i], "-repeat") == 0){
+			repeat = atoi(argv[++i]);
+		}else if(i + 1 < argc && strcmp(argv[i], "-render-every") == 0){
+			renderEvery = atoi(argv[++i]);
+		}else if(i + 1 < argc && strcmp(argv[i], "-dump") == 0){
+			dumpPrefix = argv[++i];
+		}else{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	
+	FILE * file = fopen(argv[0], "rb");
+	if(!file){
+		perror(argv[0]);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	int length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	unsigned char * data = malloc(length > 0 ? length : 1);
+	length = fread(data, 1, length, file);
+	fclose(file);
+	
+	struct ReplayReader reader;
+	if(repeat < 1) repeat = 1;
+	if(renderEvery <= 0 && !renderFinal){
+		struct GameState state;
+		double start = getSeconds();
+		long long ticks = 0;
+		for(int r = 0; r < repeat; r++){
+			if(!replayOpen(&reader, data, length, &state)){
+				fprintf(stderr, "%s is not a replay\n", argv[0]);
+				return 1;
+			}
+			replayAdvance(&reader, &state, 0x7FFFFFFF);
+			ticks += state.tick;
+		}
+		double seconds = getSeconds() - start;
+		printf("%d playbacks in %.3f s, %.0f ticks/second\n", repeat, seconds, ticks / seconds);
+		printf("tick %d, winner %d, hash %08x%s\n", state.tick, gameGetWinner(&state), gameHash(&state), reader.error ? ", replay is cut short" : "");
+		free(data);
+		return 0;
+	}
+	
+	//drawn through the emulated devices, every drawn frame is one buffer swap
+	emuPowerOn();
+	buildSprites();
+	initializeBuffer();
+	if(dumpPrefix){
+		emuDumpPrefix = dumpPrefix;
+		emuDumpEvery = 1;
+	}
+	if(!replayOpen(&reader, data, length, &game)){
+		fprintf(stderr, "%s is not a replay\n", argv[0]);
+		return 1;
+	}
+	centerCamera(FIRST);
+	markAllTilesDirty();
+	int tick = 0;
+	int running = true;
+	while(running){
+		tick = (renderEvery > 0) ? tick + renderEvery : 0x7FFFFFFF;
+		running = replayAdvance(&reader, &game, tick);
+		if(renderEvery > 0 || renderFinal){
+			renderReplayFrame();
+		}
+	}
+	if(gameGetWinner(&game) != NONE){
+		showWinningSide(gameGetWinner(&game));
+		renderReplayFrame();
+	}
+	printf("%d frames drawn, tick %d, winner %d, hash %08x\n", emuFrame, game.tick, gameGetWinner(&game), gameHash(&game));
+	free(data);
+	return 0;
+}
+
+//mixes the music with every sound effect started in turn, a quarter second apart
+//./generalio audio [seconds] [out.wav]
+int benchmarkAudio(int argc, char ** argv){
+	double seconds = (argc > 0) ? atof(argv[0]) : 60;
+	int total = seconds * AUDIO_RATE;
+	if(total < 1) total = 1;
+	short * wav = malloc(total * sizeof(short));
+	buildWaveTables();
+	updateMusic(true);
+	
+	int samples[AUDIO_FIFO_SIZE];
+	int mostVoices = 0;
+	double start = getSeconds();
+	for(int done = 0; done < total; done += AUDIO_FIFO_SIZE){
+		if(done % (AUDIO_RATE / 4) < AUDIO_FIFO_SIZE){
+			playSound(done / (AUDIO_RATE / 4) % SOUND_MUSIC);
+		}
+		int playing = 0;
+		for(int v = 0; v < AUDIO_VOICES; v++){
+			playing += voices[v].note != 0;
+		}
+		mostVoices = MAX(mostVoices, playing);
+		int count = MIN(AUDIO_FIFO_SIZE, total - done);
+		mixAudio(samples, count);
+		for(int i = 0; i < count; i++){
+			wav[done + i] = (samples[i] * (1 << AUDIO_SHIFT)) >> 16;
+		}
+	}
+	double elapsed = getSeconds() - start;
+	
+	printf("%.1f s of audio, up to %d voices, mixed in %.2f ms: %.1f ns per sample, %.4f%% of a core at %d Hz\n",
+		(double)total / AUDIO_RATE, mostVoices, elapsed * 1000, elapsed * 1e9 / total, elapsed * 100 / ((double)total / AUDIO_RATE), AUDIO_RATE);
+	int written = (argc > 1) ? writeWav(argv[1], wav, total) : true;
+	if(argc > 1 && written){
+		printf("written to %s\n", argv[1]);
+	}
+	free(wav);
+	return written ? 0 : 1;
+}
+
+/* ↑↑↑ Host Emulator ↑↑↑ */
+
+int main(int argc, char ** argv){
+	aiThreadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if(aiThreadCount < 1) aiThreadCount = 1;
+	if(aiThreadCount > AI_MAX_THREADS) aiThreadCount = AI_MAX_THREADS;
+	
+	if(argc > 1 && strcmp(argv[1], "emulate") == 0){
+		aiThreadCount = 1;	//keeps emulated runs repeatable
+		return emulateGame(argc - 2, argv + 2);
+	}
+	if(argc > 1 && strcmp(argv[1], "mapgen") == 0){
+		//./generalio mapgen [maps] [WxH] [out file]
+		int maps = (argc > 2) ? atoi(argv[2]) : 1000000;
+		int width = GRID_X;
+		int height = GRID_Y;
+		if(argc > 3) sscanf(argv[3], "%dx%d", &width, &height);
+		if(width < 2 || width > GRID_X || height < 2 || height > GRID_Y){
+			fprintf(stderr, "map size must be between 2x2 and %dx%d\n", GRID_X, GRID_Y);
+			return 1;
+		}
+		benchmarkMapGeneration(maps, width, height, (argc > 4) ? argv[4] : 0);
+		return 0;
+	}
+	if(argc > 1 && strcmp(argv[1], "replay") == 0){
+		return playReplay(argc - 2, argv + 2);
+	}
+	if(argc > 1 && strcmp(argv[1], "audio") == 0){
+		return benchmarkAudio(argc - 2, argv + 2);
+	}
+	if(argc > 1 && strcmp(argv[1], "snapshot") == 0){
+		benchmarkSnapshots();
+		return 0;
+	}
+	if(argc > 1 && strcmp(argv[1], "server") == 0){
+		return runServer(argc - 2, argv + 2);
+	}
+	if(argc > 1 && strcmp(argv[1], "loadgen") == 0){
+		return runLoadGenerator(argc - 2, argv + 2);
+	}
+	if(argc > 1 && strcmp(argv[1], "tournament") == 0){
+		return runTournament(argc - 2, argv + 2);
+	}
+	if(argc > 1 && strcmp(argv[1], "ai") == 0){
+		//./generalio ai [games] [seconds per move] [threads]
+		int games = (argc > 2) ? atoi(argv[2]) : 10;
+		double seconds = (argc > 3) ? atof(argv[3]) : 0.01;
+		if(argc > 4) aiThreadCount = atoi(argv[4]);
+		if(aiThreadCount < 1) aiThreadCount = 1;
+		if(aiThreadCount > AI_MAX_THREADS) aiThreadCount = AI_MAX_THREADS;
+		benchmarkAi(games, seconds);
+		return 0;
+	}
+	benchmarkGame();
+	return 0;
+}
+#endif
+#endif